@@ -15,7 +15,7 @@ header = fgets(file, 500);
 fprintf(1, '%s\n\n', strtrim(header));
 
 file_format_version = fread(file, 1, 'uint32');
-if file_format_version ~= 103
+if file_format_version ~= 111
     error(['Bad file format version ' num2str(file_format_version)]);
 end
 
@@ -27,6 +27,25 @@ n_kpoints = fread(file, 1, 'uint32')
 n_bands   = fread(file, 1, 'uint32')
 n_layers  = fread(file, 1, 'uint32')
 
+band_first = fread(file, 1, 'uint32')
+kpoints    = fread(file, [1 n_kpoints], 'uint32')
+
+n_energies = fread(file, 1, 'uint32');
+if n_energies ~= 0
+    error('LDOS(E, z) files are not supported')
+end
+fread(file, 2, 'double');   % Energy grid
+fread(file, 1, 'uint32');   % Broadening type
+fread(file, 1, 'double');   % Broadening width
+fread(file, 1, 'uint32');   % k-resolved flag
+
+n_windows = fread(file, 1, 'uint32');
+fread(file, 2 * n_windows, 'double');   % Partial charge energy windows
+
+n_depths = fread(file, 1, 'uint32');
+depths   = fread(file, [2 n_depths], 'double');
+
+direction        = fread(file, 1, 'uint32');   % Index of the lattice vector
 supercell_height = fread(file, 1, 'double');
 fermi_energy     = fread(file, 1, 'double');
 
@@ -34,16 +53,39 @@ energy_min = fread(file, 1, 'double');
 energy_max = fread(file, 1, 'double');
 cs_sq_max  = fread(file, 1, 'float');
 
-ks = zeros(3, n_kpoints);
-energies    = zeros(n_bands, n_kpoints);
-occupations = zeros(n_bands, n_kpoints);
-cs          = zeros(n_layers, n_bands, n_kpoints);
+layer_chunk     = fread(file, 1, 'uint32');
+band_chunk      = fread(file, 1, 'uint32');
+encoding        = fread(file, 1, 'uint32');    % 0 - float, 1 - 16-bit, 2 - 8-bit
+threshold       = fread(file, 1, 'float');
+n_snapshots     = fread(file, 1, 'uint32');
+n_blocks        = fread(file, 1, 'uint32');
+block_offsets   = fread(file, n_blocks, 'uint64');
+profile_offsets = fread(file, n_snapshots * n_spins, 'uint64');
 
-for ik = 1 : n_kpoints
-    ks(:, ik)          = fread(file, [1 3], 'double');
-    energies(:, ik)    = fread(file, [1 n_bands], 'double');
-    occupations(:, ik) = fread(file, [1 n_bands], 'double');
-    cs(:, :, ik)       = fread(file, [n_layers n_bands], 'float');
+% Positions of k-points to read in the list of selected ones (spin up only)
+% and the snapshot to read them from, other blocks are skipped
+read_kpoints = 1 : n_kpoints;
+snapshot = 1;
+snapshot_blocks = (snapshot - 1) * n_blocks / n_snapshots;
+
+% Blocks that have not been written (e.g. by an interrupted run) have zero offsets
+offsets = block_offsets(snapshot_blocks + read_kpoints);
+if any(offsets == 0)
+    warning(['Missing blocks of k-points ' num2str(read_kpoints(offsets == 0)) ' are skipped']);
+    read_kpoints = read_kpoints(offsets ~= 0);
+end
+
+ks = zeros(3, numel(read_kpoints));
+energies    = zeros(n_bands, numel(read_kpoints));
+occupations = zeros(n_bands, numel(read_kpoints));
+cs          = zeros(n_layers, n_bands, numel(read_kpoints));
+
+for i = 1 : numel(read_kpoints)
+    fseek(file, block_offsets(snapshot_blocks + read_kpoints(i)), 'bof');
+    ks(:, i)          = fread(file, [1 3], 'double');
+    energies(:, i)    = fread(file, [1 n_bands], 'double');
+    occupations(:, i) = fread(file, [1 n_bands], 'double');
+    cs(:, :, i)       = read_chunked(file, n_layers, n_bands, layer_chunk, band_chunk, encoding);
 end
 
 fclose(file);
@@ -53,3 +95,68 @@ fclose(file);
 
 figure
 plot(energies' - fermi_energy, 'k');
+
+%% ---------------------------------------------------------
+%% Reads the matrix written by chunks
+
+function m = read_chunked(file, n_rows, n_cols, row_chunk, col_chunk, encoding)
+    n_chunks = ceil(n_rows / row_chunk) * ceil(n_cols / col_chunk);
+    if encoding ~= 0
+        chunk_sizes = fread(file, n_chunks, 'uint32');
+    end
+
+    m = zeros(n_rows, n_cols);
+    i = 1;
+    for c = 1 : col_chunk : n_cols
+        cols = c : min(c + col_chunk - 1, n_cols);
+        for r = 1 : row_chunk : n_rows
+            rows = r : min(r + row_chunk - 1, n_rows);
+            if encoding == 0
+                m(rows, cols) = fread(file, [numel(rows) numel(cols)], 'float');
+            else
+                bytes = fread(file, chunk_sizes(i), 'uint8=>uint8');
+                m(rows, cols) = reshape(decode_chunk(bytes, numel(rows) * numel(cols), encoding), ...
+                    numel(rows), numel(cols));
+            end
+            i = i + 1;
+        end
+    end
+end
+
+%% Decodes the quantized chunk: float scale, then (zero run length, literal run length,
+%% literals) triples, lengths being LEB128 varints
+
+function values = decode_chunk(bytes, n, encoding)
+    q_bytes = 3 - encoding;
+    q_max = 2^(8 * q_bytes) - 1;
+
+    scale = double(typecast(bytes(1 : 4), 'single'));
+    values = zeros(n, 1);
+    pos = 5;
+    i = 0;
+    while i < n
+        [n_zeros, pos] = read_varint(bytes, pos);
+        i = i + n_zeros;
+        [n_literals, pos] = read_varint(bytes, pos);
+        for j = 1 : n_literals
+            q = double(bytes(pos : pos + q_bytes - 1));
+            values(i + j) = scale * sum(q .* 256.^(0 : q_bytes - 1)') / q_max;
+            pos = pos + q_bytes;
+        end
+        i = i + n_literals;
+    end
+end
+
+function [x, pos] = read_varint(bytes, pos)
+    x = 0;
+    shift = 0;
+    while true
+        b = double(bytes(pos));
+        pos = pos + 1;
+        x = x + bitand(b, 127) * 2^shift;
+        shift = shift + 7;
+        if b < 128
+            break
+        end
+    end
+end
@@ -0,0 +1,85 @@
+#pragma once
+#include "matrix.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Set of depths (points or slabs along the supercell direction) at which LDOS
+// is evaluated directly instead of on the full FFT grid
+class Depth_grid
+{
+public:
+	// Depths are [min, max] ranges in Angstroms, a point if min == max; slabs are sampled
+	// at midpoints of (fft_size) equal intervals per supercell (height), LDOS being averaged
+	Depth_grid(double height, std::size_t fft_size, std::vector<std::pair<double, double>> depths)
+		: height_(height), fft_size_(fft_size), depths_(std::move(depths))
+	{
+		assert(height > 0);
+		assert(!depths_.empty());
+
+		samples_first_.push_back(0);
+		for (const auto& [min, max] : depths_)
+		{
+			assert(min <= max);
+
+			const auto n = std::max(std::lround((max - min) * static_cast<double>(fft_size) / height), 1L);
+			for (long i = 0; i < n; ++i)
+				samples_.push_back(min + (max - min) * (static_cast<double>(i) + .5) / static_cast<double>(n));
+			samples_first_.push_back(samples_.size());
+		}
+	}
+
+	std::size_t size() const
+	{
+		return depths_.size();
+	}
+
+	const std::vector<std::pair<double, double>>& depths() const
+	{
+		return depths_;
+	}
+
+	std::size_t n_samples() const
+	{
+		return samples_.size();
+	}
+
+	// Returns the range of samples of the depth (i)
+	std::pair<std::size_t, std::size_t> samples(std::size_t i) const
+	{
+		return {samples_first_[i], samples_first_[i + 1]};
+	}
+
+	// Returns the matrix of phase factors exp(2 pi i m z_s / height), where (z_s) is the sample (s),
+	// and (m) is the signed frequency of the FFT box index (il) along the supercell direction
+	template<typename T>
+	Matrix<std::complex<T>> phases() const
+	{
+		Matrix<std::complex<T>> phases(samples_.size(), fft_size_);
+		for (std::size_t il = 0; il < fft_size_; ++il)
+		{
+			const auto m = (2 * il <= fft_size_) ? static_cast<double>(il) :
+				static_cast<double>(il) - static_cast<double>(fft_size_);
+
+			for (std::size_t s = 0; s < samples_.size(); ++s)
+				phases(s, il) = static_cast<std::complex<T>>(std::polar(1., 2 * PI * m * samples_[s] / height_));
+		}
+
+		return phases;
+	}
+
+private:
+	static constexpr double PI = 3.141592653589793238463;
+
+	double height_;
+	std::size_t fft_size_;
+	std::vector<std::pair<double, double>> depths_;
+
+	std::vector<double> samples_;
+	std::vector<std::size_t> samples_first_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+#ifdef HAVE_MPI
+	#include <mpi.h>
+#endif
+
+#include <cstddef>
+#include <iostream>
+#include <type_traits>
+
+// Processes the program runs in: MPI ranks, or a single process without MPI;
+// reductions leave results on the root process only
+
+#ifdef HAVE_MPI
+
+// Initializes and finalizes MPI
+class Mpi_session
+{
+public:
+	// Worker threads run alongside MPI calls, which are made by the main thread only
+	Mpi_session(int& argc, char**& argv)
+	{
+		int provided;
+		MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+		if (provided < MPI_THREAD_FUNNELED)
+		{
+			std::cerr << "MPI library does not support threads" << std::endl;
+			MPI_Abort(MPI_COMM_WORLD, -1);
+		}
+	}
+
+	~Mpi_session()
+	{
+		MPI_Finalize();
+	}
+
+	Mpi_session(const Mpi_session&) = delete;
+	Mpi_session& operator=(const Mpi_session&) = delete;
+};
+
+template<typename T>
+MPI_Datatype mpi_type()
+{
+	static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>, "Bad data type");
+	return std::is_same_v<T, float> ? MPI_FLOAT : MPI_DOUBLE;
+}
+
+#endif
+
+inline std::size_t process_rank()
+{
+#ifdef HAVE_MPI
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	return static_cast<std::size_t>(rank);
+#else
+	return 0;
+#endif
+}
+
+inline std::size_t n_processes()
+{
+#ifdef HAVE_MPI
+	int size;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	return static_cast<std::size_t>(size);
+#else
+	return 1;
+#endif
+}
+
+inline bool is_root_process()
+{
+	return process_rank() == 0;
+}
+
+// Sums (data) elementwise over processes
+template<typename T>
+void reduce_sum([[maybe_unused]] T* data, [[maybe_unused]] std::size_t count)
+{
+#ifdef HAVE_MPI
+	if (is_root_process())
+		MPI_Reduce(MPI_IN_PLACE, data, static_cast<int>(count), mpi_type<T>(), MPI_SUM, 0, MPI_COMM_WORLD);
+	else
+		MPI_Reduce(data, nullptr, static_cast<int>(count), mpi_type<T>(), MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+}
+
+template<typename T>
+T reduce_min(T value)
+{
+#ifdef HAVE_MPI
+	T min = value;
+	MPI_Reduce(&value, &min, 1, mpi_type<T>(), MPI_MIN, 0, MPI_COMM_WORLD);
+	return min;
+#else
+	return value;
+#endif
+}
+
+template<typename T>
+T reduce_max(T value)
+{
+#ifdef HAVE_MPI
+	T max = value;
+	MPI_Reduce(&value, &max, 1, mpi_type<T>(), MPI_MAX, 0, MPI_COMM_WORLD);
+	return max;
+#else
+	return value;
+#endif
+}
+
+// Terminates all processes after an error in one of them
+inline void abort_processes()
+{
+#ifdef HAVE_MPI
+	if (n_processes() > 1)
+		MPI_Abort(MPI_COMM_WORLD, -1);
+#endif
+}
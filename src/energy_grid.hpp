@@ -0,0 +1,121 @@
+#pragma once
+#include "matrix.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Uniform energy grid with a broadening function used
+// to bin band-resolved LDOS into LDOS(E, z)
+class Energy_grid
+{
+public:
+	enum class Broadening : std::uint32_t
+	{
+		GAUSSIAN = 0,
+		LORENTZIAN = 1
+	};
+
+	// Energies are absolute, [min, max] range includes both ends
+	Energy_grid(double min, double max, std::size_t size, Broadening broadening, double width)
+		: min_(min), max_(max), size_(size), broadening_(broadening), width_(width)
+	{
+		assert(min < max);
+		assert(size > 1);
+		assert(width > 0);
+	}
+
+	double min() const
+	{
+		return min_;
+	}
+
+	double max() const
+	{
+		return max_;
+	}
+
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+	Broadening broadening() const
+	{
+		return broadening_;
+	}
+
+	double width() const
+	{
+		return width_;
+	}
+
+	double energy(std::size_t i) const
+	{
+		return min_ + (max_ - min_) * static_cast<double>(i) / static_cast<double>(size_ - 1);
+	}
+
+	// Normalized broadening function (in 1/eV)
+	double weight(double energy) const
+	{
+		if (broadening_ == Broadening::GAUSSIAN)
+			return std::exp(-energy * energy / (2 * width_ * width_)) / (width_ * std::sqrt(2 * PI));
+		else
+			return width_ / (PI * (energy * energy + width_ * width_));
+	}
+
+	// Returns the range of grid points that the band with the given energy contributes to;
+	// Gaussian tails are cut off, Lorentzian ones are not
+	std::pair<std::size_t, std::size_t> range(double energy) const
+	{
+		if (broadening_ == Broadening::LORENTZIAN)
+			return {0, size_};
+
+		const auto step = (max_ - min_) / static_cast<double>(size_ - 1);
+		const auto first = std::ceil((energy - gaussian_cutoff * width_ - min_) / step);
+		const auto last = std::floor((energy + gaussian_cutoff * width_ - min_) / step) + 1;
+
+		const auto clamp = [this](double i)
+			{ return static_cast<std::size_t>(std::clamp(i, 0., static_cast<double>(size_))); };
+		return {clamp(first), clamp(last)};
+	}
+
+	// Adds contributions of bands to the columns [grid_first, grid_last) of (dos):
+	// dos(:, i) += sum_n f(E_i - energies[n]) cs_sq(:, cs_sq_first + n), n in [0, n_bands)
+	void accumulate(const double* energies, std::size_t n_bands, const Matrix<float>& cs_sq,
+					std::size_t cs_sq_first, std::size_t grid_first, std::size_t grid_last,
+					Matrix<float>& dos) const
+	{
+		assert(dos.rows() == cs_sq.rows() && dos.cols() == size_);
+
+		for (std::size_t ib = 0; ib < n_bands; ++ib)
+		{
+			const auto [first, last] = range(energies[ib]);
+			const auto column = &cs_sq(0, cs_sq_first + ib);
+
+			for (auto ie = std::max(first, grid_first); ie < std::min(last, grid_last); ++ie)
+			{
+				const auto w = static_cast<float>(weight(energy(ie) - energies[ib]));
+				for (std::size_t il = 0; il < dos.rows(); ++il)
+					dos(il, ie) += w * column[il];
+			}
+		}
+	}
+
+private:
+	static constexpr double PI = 3.141592653589793238463;
+
+	// Gaussian tails beyond this number of widths are neglected
+	static constexpr double gaussian_cutoff = 6;
+
+	double min_;
+	double max_;
+	std::size_t size_;
+
+	Broadening broadening_;
+	double width_;
+};
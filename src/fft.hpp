@@ -0,0 +1,247 @@
+#pragma once
+#include "fft_effort.hpp"
+
+#ifdef HAVE_FFTW
+	#include "fft_fftw.hpp"
+#endif
+
+#ifdef HAVE_MKL
+	#include "fft_mkl.hpp"
+#endif
+
+#if !defined(HAVE_FFTW) && !defined(HAVE_MKL)
+	#error "No FFT backend"
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <complex>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+enum class Fft_backend
+{
+	FFTW,
+	MKL
+};
+
+inline bool fft_has_backend(Fft_backend backend)
+{
+	switch (backend)
+	{
+	case Fft_backend::FFTW:
+#ifdef HAVE_FFTW
+		return true;
+#else
+		return false;
+#endif
+
+	default: // case Fft_backend::MKL:
+#ifdef HAVE_MKL
+		return true;
+#else
+		return false;
+#endif
+	}
+}
+
+inline const char* fft_backend_name(Fft_backend backend)
+{
+	return backend == Fft_backend::FFTW ? "FFTW" : "MKL";
+}
+
+// Backend used by plans created afterwards, FFTW by default if available
+inline Fft_backend& fft_backend()
+{
+	static Fft_backend backend = fft_has_backend(Fft_backend::FFTW) ? Fft_backend::FFTW : Fft_backend::MKL;
+	return backend;
+}
+
+inline void fft_set_backend(Fft_backend backend)
+{
+	if (!fft_has_backend(backend))
+		throw std::runtime_error(std::string(fft_backend_name(backend)) + " FFT backend is not available");
+
+	fft_backend() = backend;
+}
+
+// Batched in-place backward complex FFT of (n_transforms) contiguous
+// arrays of length (size) done by the current backend
+template<typename T>
+class Fft
+{
+public:
+	Fft(std::size_t size, std::size_t n_transforms, std::complex<T>* data)
+	{
+		switch (fft_backend())
+		{
+#ifdef HAVE_FFTW
+		case Fft_backend::FFTW:
+			fft_.template emplace<Fftw_fft<T>>(size, n_transforms, data);
+			break;
+#endif
+
+#ifdef HAVE_MKL
+		case Fft_backend::MKL:
+			fft_.template emplace<Mkl_fft<T>>(size, n_transforms, data);
+			break;
+#endif
+
+		default:
+			throw std::runtime_error("FFT backend is not available");
+		}
+	}
+
+	void transform() const
+	{
+		std::visit([](const auto& fft)
+		{
+			if constexpr (!std::is_same_v<std::decay_t<decltype(fft)>, std::monostate>)
+				fft.transform();
+		}, fft_);
+	}
+
+	// Transforms another array of the same shape and alignment as (data) given to the constructor
+	void transform(std::complex<T>* data) const
+	{
+		std::visit([data](const auto& fft)
+		{
+			if constexpr (!std::is_same_v<std::decay_t<decltype(fft)>, std::monostate>)
+				fft.transform(data);
+		}, fft_);
+	}
+
+private:
+	std::variant<std::monostate
+#ifdef HAVE_FFTW
+		, Fftw_fft<T>
+#endif
+#ifdef HAVE_MKL
+		, Mkl_fft<T>
+#endif
+	> fft_;
+};
+
+// Sets the planner effort, only FFTW tunes plans
+inline void fft_set_effort([[maybe_unused]] Fft_effort effort)
+{
+#ifdef HAVE_FFTW
+	Fftw_backend::set_effort(effort);
+#endif
+}
+
+// Returns true if transforms of the backend can be threaded internally
+inline bool fft_has_threads(Fft_backend backend)
+{
+	switch (backend)
+	{
+	case Fft_backend::FFTW:
+#ifdef HAVE_FFTW_THREADS
+		return true;
+#else
+		return false;
+#endif
+
+	default: // case Fft_backend::MKL:
+		return fft_has_backend(Fft_backend::MKL);
+	}
+}
+
+// Sets the number of threads each transform of the backend uses internally
+inline void fft_set_n_threads(Fft_backend backend, [[maybe_unused]] std::size_t n_threads)
+{
+	switch (backend)
+	{
+	case Fft_backend::FFTW:
+#ifdef HAVE_FFTW
+		Fftw_backend::set_n_threads(n_threads);
+#endif
+		break;
+
+	default: // case Fft_backend::MKL:
+#ifdef HAVE_MKL
+		Mkl_backend::set_n_threads(n_threads);
+#endif
+		break;
+	}
+}
+
+// Only FFTW has wisdom, returns false if none is imported
+inline bool fft_import_wisdom([[maybe_unused]] const std::string& filename)
+{
+#ifdef HAVE_FFTW
+	return Fftw_backend::import_wisdom(filename);
+#else
+	return false;
+#endif
+}
+
+inline void fft_export_wisdom([[maybe_unused]] const std::string& filename)
+{
+#ifdef HAVE_FFTW
+	Fftw_backend::export_wisdom(filename);
+#endif
+}
+
+// Releases internal data of all backends, should be called
+// when no plans exist anymore
+inline void fft_cleanup()
+{
+#ifdef HAVE_FFTW
+	Fftw_backend::cleanup();
+#endif
+#ifdef HAVE_MKL
+	Mkl_backend::cleanup();
+#endif
+}
+
+// Times transforms of the given size with each of (backends), makes the fastest one
+// current and returns it; planning time is not included
+template<typename T>
+Fft_backend fft_select_fastest_backend(const std::vector<Fft_backend>& backends,
+									   std::size_t size, std::size_t n_transforms)
+{
+	constexpr auto min_time = std::chrono::milliseconds(100);
+	constexpr std::size_t max_repeats = 20;
+
+	std::vector<std::complex<T>> data(size * n_transforms);
+	auto best_backend = fft_backend();
+	auto best_time = std::chrono::steady_clock::duration::max();
+
+	for (auto backend : backends)
+	{
+		fft_backend() = backend;
+		const Fft<T> fft(size, n_transforms, data.data());
+
+		std::fill(data.begin(), data.end(), std::complex<T>(1, 0));
+		fft.transform();	// Warm up
+
+		// The minimum time of a single transform is taken
+		auto time = std::chrono::steady_clock::duration::max();
+		auto total_time = std::chrono::steady_clock::duration::zero();
+		for (std::size_t i = 0; i < max_repeats && total_time < min_time; ++i)
+		{
+			std::fill(data.begin(), data.end(), std::complex<T>(1, 0));
+			const auto start = std::chrono::steady_clock::now();
+			fft.transform();
+			const auto t = std::chrono::steady_clock::now() - start;
+
+			time = std::min(time, t);
+			total_time += t;
+		}
+
+		if (time < best_time)
+		{
+			best_time = time;
+			best_backend = backend;
+		}
+	}
+
+	fft_backend() = best_backend;
+	return best_backend;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Planner effort of FFT backends that tune plans
+enum class Fft_effort
+{
+	ESTIMATE,
+	MEASURE,
+	PATIENT,
+	EXHAUSTIVE
+};
@@ -1,55 +1,136 @@
 #pragma once
+#include "fft_effort.hpp"
+
 #include <fftw3.h>
 
 #include <cassert>
 #include <complex>
 #include <cstddef>
+#include <mutex>
 #include <stdexcept>
+#include <string>
 #include <type_traits>
 
+// Global state of the FFTW library
+class Fftw_backend
+{
+public:
+	// Sets the planner effort of plans created afterwards
+	static void set_effort(Fft_effort effort)
+	{
+		const unsigned flags[] = {FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, FFTW_EXHAUSTIVE};
+		planner_flags() = flags[static_cast<int>(effort)];
+	}
+
+	// Sets the number of threads each plan created afterwards uses internally
+	static void set_n_threads(std::size_t n_threads)
+	{
+		assert(n_threads > 0);
+
+#ifdef HAVE_FFTW_THREADS
+		std::lock_guard<std::mutex> lock(planner_mutex());
+		static const bool is_initialized = fftwf_init_threads() && fftw_init_threads();
+		if (!is_initialized)
+			throw std::runtime_error("FFTW threads initialization failed");
+
+		fftwf_plan_with_nthreads(static_cast<int>(n_threads));
+		fftw_plan_with_nthreads(static_cast<int>(n_threads));
+#else
+		if (n_threads > 1)
+			throw std::runtime_error("FFTW is built without threads support");
+#endif
+	}
+
+	// Imports wisdom (plans tuned earlier for the same transform sizes, batches and precision)
+	// of both precisions from the file, returns false if there is no wisdom in it
+	static bool import_wisdom(const std::string& filename)
+	{
+		std::lock_guard<std::mutex> lock(planner_mutex());
+		const auto f = fftwf_import_wisdom_from_filename(filename.c_str());
+		const auto d = fftw_import_wisdom_from_filename((filename + ".double").c_str());
+		return f || d;
+	}
+
+	// Exports wisdom accumulated so far, including imported one; single and double precision
+	// wisdom goes into the file and the file with the ".double" suffix, respectively
+	static void export_wisdom(const std::string& filename)
+	{
+		std::lock_guard<std::mutex> lock(planner_mutex());
+		if (!fftwf_export_wisdom_to_filename(filename.c_str()) ||
+			!fftw_export_wisdom_to_filename((filename + ".double").c_str()))
+			throw std::runtime_error("FFTW wisdom cannot be written to '" + filename + "'");
+	}
+
+	// Releases FFTW internal data, should be called
+	// when no plans exist anymore
+	static void cleanup()
+	{
+#ifdef HAVE_FFTW_THREADS
+		fftwf_cleanup_threads();
+		fftw_cleanup_threads();
+#else
+		fftwf_cleanup();
+		fftw_cleanup();
+#endif
+	}
+
+	// FFTW planner flags used for all plans
+	static unsigned& planner_flags()
+	{
+		static unsigned flags = FFTW_ESTIMATE;
+		return flags;
+	}
+
+	// FFTW planner is not thread-safe, only fftw_execute() is
+	static std::mutex& planner_mutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+};
+
 template<typename T>
-class Fft
+class Fftw_fft
 {
 	static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "Bad data type");
 
 public:
-	Fft(std::size_t size, std::size_t n_transforms, std::complex<T>* data)
+	Fftw_fft(std::size_t size, std::size_t n_transforms, std::complex<T>* data)
 	{
 		assert(size > 0);
 		assert(n_transforms > 0);
 		const int n = static_cast<int>(size);
 
+		// Planning with efforts other than FFTW_ESTIMATE overwrites (data)
+		std::lock_guard<std::mutex> lock(Fftw_backend::planner_mutex());
+		const auto flags = Fftw_backend::planner_flags();
 		if constexpr (std::is_same_v<T, float>)
 			plan_ = fftwf_plan_many_dft(1, &n, static_cast<int>(n_transforms),
 				reinterpret_cast<fftwf_complex*>(data), nullptr, 1, n,
-				reinterpret_cast<fftwf_complex*>(data), nullptr, 1, n, FFTW_BACKWARD, FFTW_ESTIMATE);
+				reinterpret_cast<fftwf_complex*>(data), nullptr, 1, n, FFTW_BACKWARD, flags);
 		else
 			plan_ = fftw_plan_many_dft(1, &n, static_cast<int>(n_transforms),
 				reinterpret_cast<fftw_complex*>(data), nullptr, 1, n,
-				reinterpret_cast<fftw_complex*>(data), nullptr, 1, n, FFTW_BACKWARD, FFTW_ESTIMATE);
+				reinterpret_cast<fftw_complex*>(data), nullptr, 1, n, FFTW_BACKWARD, flags);
 
 		if (!plan_)
 			throw std::runtime_error("FFTW plan creation failed");
 	}
 
-	~Fft()
+	~Fftw_fft()
 	{
 		if (plan_)
 		{
+			std::lock_guard<std::mutex> lock(Fftw_backend::planner_mutex());
 			if constexpr (std::is_same_v<T, float>)
-			{
 				fftwf_destroy_plan(plan_);
-				fftwf_cleanup();
-			}
 			else
-			{
 				fftw_destroy_plan(plan_);
-				fftw_cleanup();
-			}
 		}
 	}
 
-	Fft& operator=(const Fft&) = delete;
+	Fftw_fft(const Fftw_fft&) = delete;
+	Fftw_fft& operator=(const Fftw_fft&) = delete;
 
 	void transform() const
 	{
@@ -59,6 +140,16 @@ public:
 			fftw_execute(plan_);
 	}
 
+	// Transforms another array of the same shape and alignment
+	// as the one the plan has been created for
+	void transform(std::complex<T>* data) const
+	{
+		if constexpr (std::is_same_v<T, float>)
+			fftwf_execute_dft(plan_, reinterpret_cast<fftwf_complex*>(data), reinterpret_cast<fftwf_complex*>(data));
+		else
+			fftw_execute_dft(plan_, reinterpret_cast<fftw_complex*>(data), reinterpret_cast<fftw_complex*>(data));
+	}
+
 private:
 	std::conditional_t<std::is_same_v<T, float>, fftwf_plan, fftw_plan> plan_ = nullptr;
 };
@@ -5,22 +5,117 @@
 #include <cassert>
 #include <complex>
 #include <cstddef>
+#include <list>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+
+// Global state of the MKL library
+class Mkl_backend
+{
+public:
+	// Sets the number of threads each descriptor committed afterwards uses internally,
+	// MKL threading layer should be linked for values greater than one
+	static void set_n_threads(std::size_t n_threads)
+	{
+		assert(n_threads > 0);
+
+		mkl_set_num_threads(static_cast<int>(n_threads));
+		Mkl_backend::n_threads() = n_threads;
+	}
+
+	// Releases cached descriptors and MKL internal buffers,
+	// should be called when no descriptors are used anymore
+	static void cleanup();
+
+	static std::size_t& n_threads()
+	{
+		static std::size_t n_threads = 1;
+		return n_threads;
+	}
+};
+
+// Committed descriptors that are not used at the moment, keyed by precision,
+// transform size, number of transforms and threads; the same geometry gives the same keys,
+// so descriptors are committed once and reused; beyond (max_size) descriptors,
+// the least recently returned ones are freed
+class Fft_descriptor_cache
+{
+public:
+	using Key = std::tuple<bool, std::size_t, std::size_t, std::size_t>;
+
+	static constexpr std::size_t max_size = 64;
+
+	static DFTI_DESCRIPTOR_HANDLE take(const Key& key)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		auto& handles = cache();
+		for (auto it = handles.begin(); it != handles.end(); ++it)
+			if (it->first == key)
+			{
+				const auto handle = it->second;
+				handles.erase(it);
+				return handle;
+			}
+
+		return nullptr;
+	}
+
+	static void put(const Key& key, DFTI_DESCRIPTOR_HANDLE handle)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		auto& handles = cache();
+		handles.emplace_front(key, handle);
+		if (handles.size() > max_size)
+		{
+			DftiFreeDescriptor(&handles.back().second);
+			handles.pop_back();
+		}
+	}
+
+	static void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		for (auto& [key, handle] : cache())
+			DftiFreeDescriptor(&handle);
+		cache().clear();
+	}
+
+private:
+	// The most recently returned descriptors go first
+	static std::list<std::pair<Key, DFTI_DESCRIPTOR_HANDLE>>& cache()
+	{
+		static std::list<std::pair<Key, DFTI_DESCRIPTOR_HANDLE>> cache;
+		return cache;
+	}
+
+	static std::mutex& mutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+};
 
 template<typename T>
-class Fft
+class Mkl_fft
 {
 	static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>,
 				  "Bad data type");
 
 public:
-	Fft(std::size_t size, std::size_t n_transforms, std::complex<T>* data)
-		: data_(data)
+	Mkl_fft(std::size_t size, std::size_t n_transforms, std::complex<T>* data)
+		: data_(data), key_(std::is_same_v<T, float>, size, n_transforms, Mkl_backend::n_threads())
 	{
 		assert(size > 0);
 		assert(n_transforms > 0);
 
+		handle_ = Fft_descriptor_cache::take(key_);
+		if (handle_)
+			return;
+
 		auto status = DftiCreateDescriptor(
 			&handle_, (std::is_same_v<T, float> ? DFTI_SINGLE : DFTI_DOUBLE),
 			DFTI_COMPLEX, 1, size);
@@ -31,24 +126,33 @@ public:
 		DftiSetValue(handle_, DFTI_PLACEMENT, DFTI_INPLACE);
 		DftiSetValue(handle_, DFTI_NUMBER_OF_TRANSFORMS, n_transforms);
 		DftiSetValue(handle_, DFTI_INPUT_DISTANCE, size);
+		DftiSetValue(handle_, DFTI_THREAD_LIMIT, static_cast<MKL_LONG>(Mkl_backend::n_threads()));
 
 		status = DftiCommitDescriptor(handle_);
+		if (status && !DftiErrorClass(status, DFTI_NO_ERROR))
+			DftiFreeDescriptor(&handle_);
 		check_status(status);
 	}
 
-	~Fft()
+	// The descriptor is returned to the cache to be reused
+	~Mkl_fft()
 	{
 		if (handle_)
-			DftiFreeDescriptor(&handle_);
-
-		mkl_free_buffers();
+			Fft_descriptor_cache::put(key_, handle_);
 	}
 
-	Fft& operator=(const Fft&) = delete;
+	Mkl_fft(const Mkl_fft&) = delete;
+	Mkl_fft& operator=(const Mkl_fft&) = delete;
 
 	void transform() const
 	{
-		auto status = DftiComputeBackward(handle_, data_);
+		transform(data_);
+	}
+
+	// Transforms another array of the same shape
+	void transform(std::complex<T>* data) const
+	{
+		auto status = DftiComputeBackward(handle_, data);
 		check_status(status);
 	}
 
@@ -62,4 +166,11 @@ private:
 private:
 	DFTI_DESCRIPTOR_HANDLE handle_ = nullptr;
 	std::complex<T>* const data_;
+	const Fft_descriptor_cache::Key key_;
 };
+
+inline void Mkl_backend::cleanup()
+{
+	Fft_descriptor_cache::clear();
+	mkl_free_buffers();
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "vec3.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Indices of reciprocal lattice vectors inside the cut-off sphere
+using G_sphere = std::vector<Vec3<std::size_t>>;
+
+// Thread-safe cache of G-spheres keyed by the reciprocal lattice,
+// the cut-off energy, the k-point and the Gamma-only flag (half spheres); when the total size of cached
+// spheres exceeds (max_memory), the oldest ones are evicted
+class G_sphere_cache
+{
+public:
+	G_sphere_cache(std::size_t max_memory = 512 << 20) : max_memory_(max_memory)
+	{}
+
+	std::shared_ptr<const G_sphere> find(const Basis3<double>& b, double e_cut, const Vec3<double>& k,
+										 bool is_half) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const auto& entry : entries_)
+			if (std::tie(entry.b, entry.e_cut, entry.k, entry.is_half) == std::tie(b, e_cut, k, is_half))
+				return entry.gs;
+
+		return nullptr;
+	}
+
+	void insert(const Basis3<double>& b, double e_cut, const Vec3<double>& k, bool is_half,
+				std::shared_ptr<const G_sphere> gs)
+	{
+		const auto size = gs->size() * sizeof(G_sphere::value_type);
+		if (size > max_memory_)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		while (memory_ + size > max_memory_)
+		{
+			memory_ -= entries_.front().gs->size() * sizeof(G_sphere::value_type);
+			entries_.pop_front();
+		}
+
+		entries_.push_back({b, e_cut, k, is_half, std::move(gs)});
+		memory_ += size;
+	}
+
+private:
+	struct Entry
+	{
+		Basis3<double> b;
+		double e_cut;
+		Vec3<double> k;
+		bool is_half;
+		std::shared_ptr<const G_sphere> gs;
+	};
+
+	const std::size_t max_memory_;
+	std::size_t memory_ = 0;
+
+	std::deque<Entry> entries_;
+	mutable std::mutex mutex_;
+};
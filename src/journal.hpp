@@ -0,0 +1,166 @@
+#pragma once
+#include "distributed.hpp"
+#include "ldos_writer.hpp"
+#include "matrix.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Progress of a run: the number of (spin, k-point) items done by the process,
+// the first snapshot whose sums have not been written, and sums and extreme values
+// over the items done; maximum values, profiles and LDOS sums are kept for each cell direction
+struct Progress
+{
+	std::size_t n_items_done = 0;
+	std::size_t snapshot = 0;
+
+	double energy_min;
+	double energy_max;
+	std::vector<float> cs_sq_max;
+	std::vector<float> dos_max;
+
+	std::vector<Matrix<float>> profiles;
+	std::vector<Matrix<float>> doss;
+};
+
+// Sidecar file with the progress of a run and the states of its output writers,
+// from which an interrupted run can be resumed; the file is replaced atomically
+// on each update, so that it is always consistent with the output file;
+// the run hash identifies the run parameters
+class Journal
+{
+public:
+	Journal(std::string filename) : filename_(std::move(filename))
+	{}
+
+	bool exists() const
+	{
+		return std::ifstream(filename_).good();
+	}
+
+	// Reads the journal and returns the run hash, the sizes of (progress) vectors and matrices
+	// and the number of (writer_states) should be set and are checked against the journal
+	std::uint64_t read(Progress& progress, std::vector<Ldos_writer_state>& writer_states) const
+	{
+		std::ifstream file;
+		file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		file.open(filename_, std::ifstream::binary);
+
+		const auto read = [&file](auto* data, std::size_t count)
+		{
+			file.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(sizeof(*data) * count));
+		};
+
+		const auto read_offsets = [&read](std::vector<std::uint64_t>& offsets)
+		{
+			std::uint64_t size;
+			read(&size, 1);
+			offsets.resize(size);
+			read(offsets.data(), offsets.size());
+		};
+
+		try
+		{
+			std::uint32_t version;
+			std::uint64_t header[6];
+			read(&version, 1);
+			read(header, std::size(header));
+			if (version != journal_version || header[1] != n_processes() || header[2] != process_rank() ||
+				header[5] != writer_states.size())
+				throw std::runtime_error("");
+
+			progress.n_items_done = header[3];
+			progress.snapshot = header[4];
+			for (auto& writer_state : writer_states)
+			{
+				std::uint64_t position[2];
+				read(position, std::size(position));
+				writer_state.pos = position[0];
+				writer_state.next_block = position[1];
+				read_offsets(writer_state.block_offsets);
+				read_offsets(writer_state.profile_offsets);
+			}
+
+			read(&progress.energy_min, 1);
+			read(&progress.energy_max, 1);
+			read(progress.cs_sq_max.data(), progress.cs_sq_max.size());
+			read(progress.dos_max.data(), progress.dos_max.size());
+			for (auto& profile : progress.profiles)
+				read(profile.data(), profile.size());
+			for (auto& dos : progress.doss)
+				read(dos.data(), dos.size());
+
+			if (file.peek() != std::ifstream::traits_type::eof())
+				throw std::runtime_error("");
+
+			return header[0];
+		}
+		catch (const std::exception&)
+		{
+			throw std::runtime_error("Journal '" + filename_ + "' belongs to another run");
+		}
+	}
+
+	void write(std::uint64_t run_hash, const Progress& progress, const std::vector<Ldos_writer_state>& writer_states) const
+	{
+		const auto tmp_filename = filename_ + ".tmp";
+		{
+			std::ofstream file;
+			file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+			file.open(tmp_filename, std::ofstream::binary);
+
+			const auto write = [&file](const auto* data, std::size_t count)
+			{
+				file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(sizeof(*data) * count));
+			};
+
+			const auto write_offsets = [&write](const std::vector<std::uint64_t>& offsets)
+			{
+				const std::uint64_t size = offsets.size();
+				write(&size, 1);
+				write(offsets.data(), offsets.size());
+			};
+
+			const std::uint64_t header[] = {run_hash, n_processes(), process_rank(),
+				progress.n_items_done, progress.snapshot, writer_states.size()};
+			write(&journal_version, 1);
+			write(header, std::size(header));
+			for (const auto& writer_state : writer_states)
+			{
+				const std::uint64_t position[] = {writer_state.pos, writer_state.next_block};
+				write(position, std::size(position));
+				write_offsets(writer_state.block_offsets);
+				write_offsets(writer_state.profile_offsets);
+			}
+
+			write(&progress.energy_min, 1);
+			write(&progress.energy_max, 1);
+			write(progress.cs_sq_max.data(), progress.cs_sq_max.size());
+			write(progress.dos_max.data(), progress.dos_max.size());
+			for (const auto& profile : progress.profiles)
+				write(profile.data(), profile.size());
+			for (const auto& dos : progress.doss)
+				write(dos.data(), dos.size());
+		}
+
+		if (std::rename(tmp_filename.c_str(), filename_.c_str()) != 0)
+			throw std::runtime_error("Journal '" + filename_ + "' cannot be written");
+	}
+
+	void remove() const
+	{
+		std::remove(filename_.c_str());
+	}
+
+private:
+	static constexpr std::uint32_t journal_version = 2;
+
+	const std::string filename_;
+};
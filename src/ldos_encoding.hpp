@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Encoding of LDOS chunks in output files: raw floats, or values quantized to 16 or 8 bits
+// relative to the chunk maximum with runs of zeros compressed
+enum class Ldos_encoding
+{
+	FLOAT,
+	UINT16,
+	UINT8
+};
+
+// Quantized chunk layout: float scale (the chunk maximum), then (zero run length, literal run length,
+// literal values) triples until all values are covered; lengths are LEB128 varints,
+// literals are little-endian unsigned integers (q), the value being (scale * q / q_max);
+// values less than (threshold) are stored as zeros
+template<typename Q>
+void encode_quantized_chunk(const float* values, std::size_t n, float threshold, std::vector<unsigned char>& out)
+{
+	static_assert(std::is_unsigned_v<Q>, "Bad quantized type");
+	constexpr auto q_max = std::numeric_limits<Q>::max();
+
+	const auto put_varint = [&out](std::size_t x)
+	{
+		for (; x >= 0x80; x >>= 7)
+			out.push_back(static_cast<unsigned char>(x | 0x80));
+		out.push_back(static_cast<unsigned char>(x));
+	};
+
+	const auto scale = std::max(0.f, *std::max_element(values, values + n));
+	std::vector<Q> qs(n, 0);
+	if (scale > 0)
+		for (std::size_t i = 0; i < n; ++i)
+			if (values[i] >= threshold)
+				qs[i] = static_cast<Q>(std::min<float>(std::round(values[i] / scale * q_max), q_max));
+
+	out.resize(sizeof(float));
+	std::memcpy(out.data(), &scale, sizeof(float));
+
+	for (std::size_t i = 0; i < n;)
+	{
+		auto first = i;
+		while (i < n && qs[i] == 0)
+			++i;
+		put_varint(i - first);
+
+		first = i;
+		while (i < n && qs[i] != 0)
+			++i;
+		put_varint(i - first);
+
+		for (auto j = first; j < i; ++j)
+			for (std::size_t b = 0; b < sizeof(Q); ++b)
+				out.push_back(static_cast<unsigned char>(qs[j] >> (8 * b)));
+	}
+}
+
+template<typename Q>
+void decode_quantized_chunk(const unsigned char* data, std::size_t size, float* values, std::size_t n)
+{
+	constexpr auto q_max = std::numeric_limits<Q>::max();
+	const auto bad_chunk = [] { throw std::runtime_error("Bad LDOS file: Corrupted chunk"); };
+
+	const auto end = data + size;
+	const auto get_varint = [&]
+	{
+		std::size_t x = 0;
+		for (unsigned shift = 0;; shift += 7)
+		{
+			if (data == end || shift >= 64)
+				bad_chunk();
+
+			const auto byte = *data++;
+			x |= static_cast<std::size_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return x;
+		}
+	};
+
+	if (size < sizeof(float))
+		bad_chunk();
+
+	float scale;
+	std::memcpy(&scale, data, sizeof(float));
+	data += sizeof(float);
+
+	for (std::size_t i = 0; i < n;)
+	{
+		const auto n_zeros = get_varint();
+		if (n_zeros > n - i)
+			bad_chunk();
+		std::fill_n(values + i, n_zeros, 0.f);
+		i += n_zeros;
+
+		const auto n_literals = get_varint();
+		if ((n_zeros == 0 && n_literals == 0) || n_literals > n - i || n_literals * sizeof(Q) > static_cast<std::size_t>(end - data))
+			bad_chunk();
+
+		for (std::size_t j = 0; j < n_literals; ++j, ++i)
+		{
+			std::uint64_t q = 0;
+			for (std::size_t b = 0; b < sizeof(Q); ++b)
+				q |= static_cast<std::uint64_t>(*data++) << (8 * b);
+			values[i] = scale * static_cast<float>(q) / q_max;
+		}
+	}
+}
+
+// Encodes (n) values of a chunk into (out), FLOAT chunks are not encoded
+inline void encode_ldos_chunk(Ldos_encoding encoding, const float* values, std::size_t n, float threshold,
+							  std::vector<unsigned char>& out)
+{
+	if (encoding == Ldos_encoding::UINT16)
+		encode_quantized_chunk<std::uint16_t>(values, n, threshold, out);
+	else
+	{
+		assert(encoding == Ldos_encoding::UINT8);
+		encode_quantized_chunk<std::uint8_t>(values, n, threshold, out);
+	}
+}
+
+inline void decode_ldos_chunk(Ldos_encoding encoding, const unsigned char* data, std::size_t size,
+							  float* values, std::size_t n)
+{
+	if (encoding == Ldos_encoding::UINT16)
+		decode_quantized_chunk<std::uint16_t>(data, size, values, n);
+	else
+	{
+		assert(encoding == Ldos_encoding::UINT8);
+		decode_quantized_chunk<std::uint8_t>(data, size, values, n);
+	}
+}
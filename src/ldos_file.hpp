@@ -0,0 +1,448 @@
+#pragma once
+#include "ldos_encoding.hpp"
+#include "mapped_file.hpp"
+#include "matrix.hpp"
+#include "vec3.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Reader of LDOS files written by Ldos_writer (format version 111); the file is memory-mapped,
+// and the block index and chunking let slices be read without touching the rest of the file;
+// k-point indices are positions in the list of selected k-points, band indices are relative
+// to the first selected band; snapshot indices are zero-based
+class Ldos_file
+{
+public:
+	Ldos_file(const std::string& filename)
+		: file_(filename)
+	{
+		file_.advise_random();
+
+		std::size_t pos = header_length;
+		if (read<std::uint32_t>(pos) != file_format_version)
+			throw std::runtime_error("Unsupported LDOS file format version");
+
+		for (auto& v : a_)
+			v = read<Vec3<double>>(pos);
+		for (auto& v : b_)
+			v = read<Vec3<double>>(pos);
+
+		n_spins_ = read<std::uint32_t>(pos);
+		const std::size_t n_kpoints = read<std::uint32_t>(pos);
+		n_bands_ = read<std::uint32_t>(pos);
+		n_layers_ = read<std::uint32_t>(pos);
+
+		band_first_ = read<std::uint32_t>(pos) - 1;
+		for (std::size_t i = 0; i < n_kpoints; ++i)
+			kpoints_.push_back(read<std::uint32_t>(pos) - 1);
+
+		n_energies_ = read<std::uint32_t>(pos);
+		energy_grid_min_ = read<double>(pos);
+		energy_grid_max_ = read<double>(pos);
+		pos += sizeof(std::uint32_t) + sizeof(double);		// Broadening type and width
+		is_k_resolved_ = read<std::uint32_t>(pos);
+
+		partial_windows_ = read_ranges(pos);
+		depths_ = read_ranges(pos);
+
+		direction_ = read<std::uint32_t>(pos);
+		supercell_height_ = read<double>(pos);
+		fermi_energy_ = read<double>(pos);
+		energy_min_ = read<double>(pos);
+		energy_max_ = read<double>(pos);
+		ldos_max_ = read<float>(pos);
+
+		layer_chunk_ = read<std::uint32_t>(pos);
+		column_chunk_ = read<std::uint32_t>(pos);
+		encoding_ = static_cast<Ldos_encoding>(read<std::uint32_t>(pos));
+		pos += sizeof(float);	// Threshold
+		n_snapshots_ = read<std::uint32_t>(pos);
+		const std::size_t n_blocks = read<std::uint32_t>(pos);
+		if (encoding_ > Ldos_encoding::UINT8 || direction_ > 2 || n_spins_ == 0 || n_kpoints == 0 || n_layers_ == 0 ||
+			layer_chunk_ == 0 || column_chunk_ == 0 || n_snapshots_ == 0 ||
+			n_blocks != n_snapshots_ * (is_summed() ? n_spins_ : n_spins_ * n_kpoints))
+			throw std::runtime_error("Bad LDOS file header");
+
+		for (std::size_t i = 0; i < n_blocks; ++i)
+			block_offsets_.push_back(read<std::uint64_t>(pos));
+		for (std::size_t i = 0; i < n_snapshots_ * n_spins_; ++i)
+			profile_offsets_.push_back(read<std::uint64_t>(pos));
+
+		// Sizes of encoded chunks are checked when they are read
+		const auto block_size = (is_summed() ? 0 : sizeof(Vec3<double>)) +
+			(n_energies_ > 0 ? 0 : 2 * sizeof(double) * n_bands_) + (encoding_ == Ldos_encoding::FLOAT ?
+			sizeof(float) * n_layers_ * n_columns() : sizeof(std::uint32_t) * n_chunks());
+		for (auto offset : block_offsets_)
+			check_range(offset, block_size);
+		for (auto offset : profile_offsets_)
+			check_range(offset, sizeof(float) * n_layers_ * (partial_windows_.size() + 1));
+	}
+
+	const Basis3<double>& a() const
+	{
+		return a_;
+	}
+
+	const Basis3<double>& b() const
+	{
+		return b_;
+	}
+
+	std::size_t n_spins() const
+	{
+		return n_spins_;
+	}
+
+	std::size_t n_kpoints() const
+	{
+		return kpoints_.size();
+	}
+
+	std::size_t n_bands() const
+	{
+		return n_bands_;
+	}
+
+	// Number of WAVECAR snapshots in the file
+	std::size_t n_snapshots() const
+	{
+		return n_snapshots_;
+	}
+
+	std::size_t n_layers() const
+	{
+		return n_layers_;
+	}
+
+	// Number of energy grid points, zero if LDOS is band-resolved
+	std::size_t n_energies() const
+	{
+		return n_energies_;
+	}
+
+	// Zero-based index of the first selected band in the WAVECAR file
+	std::size_t band_first() const
+	{
+		return band_first_;
+	}
+
+	// Zero-based indices of the selected k-points in the WAVECAR file
+	const std::vector<std::size_t>& kpoints() const
+	{
+		return kpoints_;
+	}
+
+	double energy_grid_min() const
+	{
+		return energy_grid_min_;
+	}
+
+	double energy_grid_max() const
+	{
+		return energy_grid_max_;
+	}
+
+	bool is_k_resolved() const
+	{
+		return is_k_resolved_;
+	}
+
+	const std::vector<std::pair<double, double>>& partial_windows() const
+	{
+		return partial_windows_;
+	}
+
+	// Empty if the layers are FFT grid points
+	const std::vector<std::pair<double, double>>& depths() const
+	{
+		return depths_;
+	}
+
+	// Index of the lattice vector LDOS is resolved along
+	std::size_t direction() const
+	{
+		return direction_;
+	}
+
+	double supercell_height() const
+	{
+		return supercell_height_;
+	}
+
+	double fermi_energy() const
+	{
+		return fermi_energy_;
+	}
+
+	double energy_min() const
+	{
+		return energy_min_;
+	}
+
+	double energy_max() const
+	{
+		return energy_max_;
+	}
+
+	float ldos_max() const
+	{
+		return ldos_max_;
+	}
+
+	// Returns false if the block has not been written, e.g. processing was interrupted
+	bool has_block(std::size_t spin, std::size_t kpoint, std::size_t snapshot = 0) const
+	{
+		return block_offsets_[block_index(spin, kpoint, snapshot)] != 0;
+	}
+
+	Vec3<double> k(std::size_t spin, std::size_t kpoint, std::size_t snapshot = 0) const
+	{
+		assert(!is_summed());
+
+		auto pos = block_offset(spin, kpoint, snapshot);
+		return read<Vec3<double>>(pos);
+	}
+
+	std::vector<double> energies(std::size_t spin, std::size_t kpoint, std::size_t snapshot = 0) const
+	{
+		return band_values(spin, kpoint, snapshot, 0);
+	}
+
+	std::vector<double> occupations(std::size_t spin, std::size_t kpoint, std::size_t snapshot = 0) const
+	{
+		return band_values(spin, kpoint, snapshot, 1);
+	}
+
+	// Returns band-resolved LDOS of the layers [layer_first, layer_first + n_layers)
+	// and the bands [band_first, band_first + n_bands), a row per layer
+	Matrix<float> ldos(std::size_t spin, std::size_t kpoint, std::size_t band_first, std::size_t n_bands,
+					   std::size_t layer_first, std::size_t n_layers, std::size_t snapshot = 0) const
+	{
+		assert(n_energies_ == 0);
+		assert(band_first + n_bands <= n_bands_);
+
+		const auto offset = block_offset(spin, kpoint, snapshot) + sizeof(Vec3<double>) + 2 * sizeof(double) * n_bands_;
+		return read_slice(offset, band_first, n_bands, layer_first, n_layers);
+	}
+
+	// Returns LDOS(E, z) of the layers [layer_first, layer_first + n_layers) at the energy
+	// grid points [energy_first, energy_first + n_energies), a row per layer;
+	// if it is summed over k-points, (kpoint) should be zero
+	Matrix<float> dos(std::size_t spin, std::size_t kpoint, std::size_t energy_first, std::size_t n_energies,
+					  std::size_t layer_first, std::size_t n_layers, std::size_t snapshot = 0) const
+	{
+		assert(n_energies_ > 0);
+		assert(energy_first + n_energies <= n_energies_);
+
+		const auto offset = block_offset(spin, kpoint, snapshot) + (is_summed() ? 0 : sizeof(Vec3<double>));
+		return read_slice(offset, energy_first, n_energies, layer_first, n_layers);
+	}
+
+	// Returns charge density (the first column) and partial charge density profiles
+	Matrix<float> profiles(std::size_t spin, std::size_t snapshot = 0) const
+	{
+		assert(spin < n_spins_);
+		assert(snapshot < n_snapshots_);
+
+		const auto offset = profile_offsets_[snapshot * n_spins_ + spin];
+		if (offset == 0)
+			throw std::runtime_error("Charge density profiles are missing in LDOS file");
+
+		Matrix<float> profiles(n_layers_, partial_windows_.size() + 1);
+		std::memcpy(profiles.data(), file_.data() + offset, sizeof(float) * profiles.size());
+		return profiles;
+	}
+
+private:
+	template<typename T>
+	T read(std::size_t& pos) const
+	{
+		check_range(pos, sizeof(T));
+
+		T value;
+		std::memcpy(&value, file_.data() + pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+
+	std::vector<std::pair<double, double>> read_ranges(std::size_t& pos) const
+	{
+		std::vector<std::pair<double, double>> ranges(read<std::uint32_t>(pos));
+		for (auto& [min, max] : ranges)
+		{
+			min = read<double>(pos);
+			max = read<double>(pos);
+		}
+
+		return ranges;
+	}
+
+	void check_range(std::size_t offset, std::size_t length) const
+	{
+		if (offset > file_.size() || length > file_.size() - offset)
+			throw std::runtime_error("Bad LDOS file: Unexpected end of file");
+	}
+
+	// LDOS(E, z) summed over k-points has a block per spin projection
+	bool is_summed() const
+	{
+		return n_energies_ > 0 && !is_k_resolved_;
+	}
+
+	std::size_t n_columns() const
+	{
+		return n_energies_ > 0 ? n_energies_ : n_bands_;
+	}
+
+	std::size_t n_layer_chunks() const
+	{
+		return (n_layers_ + layer_chunk_ - 1) / layer_chunk_;
+	}
+
+	std::size_t n_chunks() const
+	{
+		return n_layer_chunks() * ((n_columns() + column_chunk_ - 1) / column_chunk_);
+	}
+
+	// Blocks of each snapshot follow those of the previous one
+	std::size_t block_index(std::size_t spin, std::size_t kpoint, std::size_t snapshot) const
+	{
+		assert(spin < n_spins_);
+		assert(is_summed() ? kpoint == 0 : kpoint < kpoints_.size());
+		assert(snapshot < n_snapshots_);
+
+		const auto n_snapshot_blocks = block_offsets_.size() / n_snapshots_;
+		return snapshot * n_snapshot_blocks + (is_summed() ? spin : spin * kpoints_.size() + kpoint);
+	}
+
+	std::size_t block_offset(std::size_t spin, std::size_t kpoint, std::size_t snapshot) const
+	{
+		const auto offset = block_offsets_[block_index(spin, kpoint, snapshot)];
+		if (offset == 0)
+			throw std::runtime_error("Block is missing in LDOS file");
+
+		return offset;
+	}
+
+	std::vector<double> band_values(std::size_t spin, std::size_t kpoint, std::size_t snapshot, std::size_t index) const
+	{
+		assert(n_energies_ == 0);
+
+		const auto offset = block_offset(spin, kpoint, snapshot) + sizeof(Vec3<double>) + index * sizeof(double) * n_bands_;
+		std::vector<double> values(n_bands_);
+		std::memcpy(values.data(), file_.data() + offset, sizeof(double) * n_bands_);
+		return values;
+	}
+
+	// Reads the slice of the matrix written by chunks at (offset), only the chunks
+	// that overlap the slice are touched
+	Matrix<float> read_slice(std::size_t offset, std::size_t col_first, std::size_t n_cols,
+							 std::size_t layer_first, std::size_t n_layers) const
+	{
+		assert(n_cols > 0 && n_layers > 0);
+		assert(layer_first + n_layers <= n_layers_);
+
+		const auto col_last = col_first + n_cols;
+		const auto layer_last = layer_first + n_layers;
+
+		// Offsets of encoded chunks follow from the table of their sizes
+		std::vector<std::size_t> chunk_offsets;
+		if (encoding_ != Ldos_encoding::FLOAT)
+		{
+			auto pos = offset;
+			chunk_offsets.push_back(offset + sizeof(std::uint32_t) * n_chunks());
+			for (std::size_t i = 0; i < n_chunks(); ++i)
+				chunk_offsets.push_back(chunk_offsets.back() + read<std::uint32_t>(pos));
+		}
+
+		Matrix<float> slice(n_layers, n_cols);
+		std::vector<float> buffer;
+		for (auto chunk_col_first = col_first / column_chunk_ * column_chunk_;
+			 chunk_col_first < col_last; chunk_col_first += column_chunk_)
+		{
+			const auto chunk_n_cols = std::min(column_chunk_, n_columns() - chunk_col_first);
+			for (auto chunk_layer_first = layer_first / layer_chunk_ * layer_chunk_;
+				 chunk_layer_first < layer_last; chunk_layer_first += layer_chunk_)
+			{
+				const auto chunk_n_layers = std::min(layer_chunk_, n_layers_ - chunk_layer_first);
+
+				// Raw chunks are used directly, encoded ones are decoded into (buffer)
+				const char* data;
+				if (encoding_ == Ldos_encoding::FLOAT)
+					data = file_.data() + offset +
+						sizeof(float) * (chunk_col_first * n_layers_ + chunk_layer_first * chunk_n_cols);
+				else
+				{
+					const auto chunk = chunk_col_first / column_chunk_ * n_layer_chunks() + chunk_layer_first / layer_chunk_;
+					const auto first = chunk_offsets[chunk];
+					const auto size = chunk_offsets[chunk + 1] - first;
+					check_range(first, size);
+
+					buffer.resize(chunk_n_layers * chunk_n_cols);
+					decode_ldos_chunk(encoding_, reinterpret_cast<const unsigned char*>(file_.data() + first), size,
+						buffer.data(), buffer.size());
+					data = reinterpret_cast<const char*>(buffer.data());
+				}
+
+				const auto first_col = std::max(col_first, chunk_col_first);
+				const auto last_col = std::min(col_last, chunk_col_first + chunk_n_cols);
+				const auto first = std::max(layer_first, chunk_layer_first);
+				const auto last = std::min(layer_last, chunk_layer_first + chunk_n_layers);
+
+				for (auto col = first_col; col < last_col; ++col)
+				{
+					const auto element = (col - chunk_col_first) * chunk_n_layers + (first - chunk_layer_first);
+					std::memcpy(&slice(first - layer_first, col - col_first), data + sizeof(float) * element,
+						sizeof(float) * (last - first));
+				}
+			}
+		}
+
+		return slice;
+	}
+
+private:
+	static constexpr std::size_t header_length = 500;
+	static constexpr std::uint32_t file_format_version = 111;
+
+	Mapped_file file_;
+
+	Basis3<double> a_;
+	Basis3<double> b_;
+
+	std::size_t n_spins_;
+	std::size_t n_snapshots_;
+	std::size_t n_bands_;
+	std::size_t n_layers_;
+	std::size_t n_energies_;
+	std::size_t band_first_;
+	std::vector<std::size_t> kpoints_;
+
+	double energy_grid_min_;
+	double energy_grid_max_;
+	bool is_k_resolved_;
+
+	std::vector<std::pair<double, double>> partial_windows_;
+	std::vector<std::pair<double, double>> depths_;
+
+	std::size_t direction_;
+	double supercell_height_;
+	double fermi_energy_;
+	double energy_min_;
+	double energy_max_;
+	float ldos_max_;
+
+	std::size_t layer_chunk_;
+	std::size_t column_chunk_;
+	Ldos_encoding encoding_;
+	std::vector<std::uint64_t> block_offsets_;
+	std::vector<std::uint64_t> profile_offsets_;
+};
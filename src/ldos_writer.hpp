@@ -1,8 +1,15 @@
 #pragma once
+#include "distributed.hpp"
+#include "energy_grid.hpp"
+#include "ldos_encoding.hpp"
 #include "matrix.hpp"
+#include "output_file.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
 #include "vec3.hpp"
 #include "wavecar_reader.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstddef>
@@ -11,31 +18,79 @@
 #include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+// Layout of LDOS matrices in the output file
+struct Ldos_format
+{
+	// Sizes of chunks in layers and in bands or energy grid points, zero meaning the whole dimension
+	std::size_t layer_chunk = 0;
+	std::size_t column_chunk = 0;
+
+	Ldos_encoding encoding = Ldos_encoding::FLOAT;
+	float threshold = 0;		// Values less than (threshold) times the block maximum are stored as zeros
+	std::size_t n_threads = 1;	// Number of threads chunks are encoded by
+};
+
+// Position of the writer in the output file, saved to resume interrupted runs
+struct Ldos_writer_state
+{
+	std::uint64_t pos;
+	std::size_t next_block;
+	std::vector<std::uint64_t> block_offsets;
+	std::vector<std::uint64_t> profile_offsets;
+};
+
 class Ldos_writer
 {
 public:
-	Ldos_writer(const std::string& filename, const Wavecar_reader& reader,
-				std::size_t n_layers, double supercell_height, double fermi_energy,
-				const std::string& user_comment)
-		: n_bands_(reader.n_bands()), n_layers_(n_layers)
+	// LDOS is resolved along the lattice vector a[direction], (n_layers) being its layers;
+	// if (energy_grid) is not null, LDOS(E, z) on that grid is written instead of
+	// band-resolved LDOS, either for each k-point or summed over them;
+	// (partial_windows) are energy windows of partial charge density profiles;
+	// if (depths) are not empty, the layers are these depths, not the FFT grid points;
+	// with multiple processes, all of them should create the writer, and the root one
+	// writes everything but the blocks of other processes; the file may contain (n_snapshots)
+	// snapshots of the same geometry, each followed by its profiles; if (is_resumed) is true,
+	// the existing file is continued, its header should match the given parameters
+	Ldos_writer(const std::string& filename, const Wavecar_reader& reader, const Selection& selection,
+				std::size_t direction, std::size_t n_layers, double supercell_height, double fermi_energy,
+				const std::string& user_comment, const Energy_grid* energy_grid = nullptr,
+				bool is_k_resolved = false, const std::vector<std::pair<double, double>>& partial_windows = {},
+				const std::vector<std::pair<double, double>>& depths = {},
+				const Ldos_format& format = {}, std::size_t n_snapshots = 1, bool is_resumed = false)
+		: band_first_(selection.band_first), n_bands_(selection.n_bands), n_layers_(n_layers),
+		  n_energies_(energy_grid ? energy_grid->size() : 0), n_profiles_(partial_windows.size() + 1),
+		  n_spins_(reader.n_spins()), n_snapshots_(n_snapshots),
+		  n_snapshot_blocks_(energy_grid && !is_k_resolved ? n_spins_ : n_spins_ * selection.kpoints.size()),
+		  n_blocks_(n_snapshots * n_snapshot_blocks_),
+		  layer_chunk_(chunk_size(format.layer_chunk, n_layers)),
+		  column_chunk_(chunk_size(format.column_chunk, energy_grid ? n_energies_ : n_bands_)),
+		  encoding_(format.encoding), threshold_(format.threshold), n_threads_(format.n_threads),
+		  file_(filename, !is_resumed), block_offsets_(n_blocks_, 0)
 	{
+		assert(n_threads_ > 0);
+		assert(n_snapshots_ > 0);
+
 		assert(reader.n_spins() > 0);
-		assert(reader.n_kpoints() > 0);
-		assert(reader.n_bands() > 0);
+		assert(!selection.kpoints.empty());
+		assert(selection.n_bands > 0);
+		assert(selection.band_first + selection.n_bands <= reader.n_bands());
+		assert(direction < 3);
 		assert(n_layers > 0);
-
-		file_.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-		file_.open(filename, std::ofstream::binary);
+		assert(depths.empty() || depths.size() == n_layers);
 
 		const std::size_t header_length = 500;
 		std::string header("Depth-k resolved DOS data file, created on: ");
 		header += date_time_string() + "; " +
-			std::to_string(reader.n_kpoints()) + " k points, " +
-			std::to_string(reader.n_bands()) + " bands, " +
-			std::to_string(n_layers) + " layers";
+			std::to_string(selection.kpoints.size()) + " k points, " +
+			std::to_string(selection.n_bands) + " bands, " +
+			std::to_string(n_layers) + " layers along a" + std::to_string(direction);
+		if (n_snapshots > 1)
+			header += ", " + std::to_string(n_snapshots) + " snapshots";
 
 		if (!user_comment.empty())
 			header += "; Comment: " + user_comment;
@@ -43,59 +98,325 @@ public:
 		header.resize(header_length, ' ');
 		write(header.c_str(), header.length());
 
-		const std::uint32_t file_format_version = 103;
+		const std::uint32_t file_format_version = 111;
 		write(file_format_version);
 
 		write(reader.a());
 		write(reader.b());
 
 		write(static_cast<std::uint32_t>(reader.n_spins()));
-		write(static_cast<std::uint32_t>(reader.n_kpoints()));
-		write(static_cast<std::uint32_t>(reader.n_bands()));
+		write(static_cast<std::uint32_t>(selection.kpoints.size()));
+		write(static_cast<std::uint32_t>(selection.n_bands));
 		write(static_cast<std::uint32_t>(n_layers));
+
+		// One-based indices of the first band and of k-points in the WAVECAR file
+		write(static_cast<std::uint32_t>(selection.band_first + 1));
+		for (auto kpoint : selection.kpoints)
+			write(static_cast<std::uint32_t>(kpoint + 1));
+
+		write(static_cast<std::uint32_t>(n_energies_));
+		write(energy_grid ? energy_grid->min() : 0.);
+		write(energy_grid ? energy_grid->max() : 0.);
+		write(static_cast<std::uint32_t>(energy_grid ? energy_grid->broadening() : Energy_grid::Broadening{}));
+		write(energy_grid ? energy_grid->width() : 0.);
+		write(static_cast<std::uint32_t>(is_k_resolved));
+
+		write(static_cast<std::uint32_t>(partial_windows.size()));
+		for (const auto& [min, max] : partial_windows)
+		{
+			write(min);
+			write(max);
+		}
+
+		write(static_cast<std::uint32_t>(depths.size()));
+		for (const auto& [min, max] : depths)
+		{
+			write(min);
+			write(max);
+		}
+
+		write(static_cast<std::uint32_t>(direction));
 		write(supercell_height);
 		write(fermi_energy);
 
-		minmax_values_pos_ = file_.tellp();
+		minmax_values_pos_ = buffer_.size();
 		write(0.);	// Reserved for energy_min
 		write(0.);	// Reserved for energy_max
 		write(0.f); // Reserved for cs_sq_max
+
+		write(static_cast<std::uint32_t>(layer_chunk_));
+		write(static_cast<std::uint32_t>(column_chunk_));
+		write(static_cast<std::uint32_t>(encoding_));
+		write(threshold_);
+		write(static_cast<std::uint32_t>(n_snapshots_));
+		write(static_cast<std::uint32_t>(n_blocks_));
+
+		index_pos_ = buffer_.size();
+		const std::vector<std::uint64_t> index(n_blocks_ + n_snapshots_ * n_spins_, 0);
+		write(index.data(), index.size());	// Reserved for block and profile offsets
+
+		// The header does not depend on the date and the comment
+		header_hash_ = 14695981039346656037ull;
+		for (auto i = header_length; i < buffer_.size(); ++i)
+			header_hash_ = (header_hash_ ^ static_cast<unsigned char>(buffer_[i])) * 1099511628211ull;
+
+		if (is_resumed)
+			check_header(filename, header_length);
+		flush(is_root_process() && !is_resumed);
+		blocks_pos_ = pos_;
+
+		// Without encoding, blocks and snapshots have fixed sizes
+		const auto is_summed = energy_grid && !is_k_resolved;
+		block_size_ = (is_summed ? 0 : sizeof(Vec3<double>)) + (energy_grid ? 0 : 2 * sizeof(double) * n_bands_) +
+			sizeof(float) * n_layers * (energy_grid ? n_energies_ : n_bands_);
+		snapshot_size_ = n_snapshot_blocks_ * block_size_ + n_spins_ * sizeof(float) * n_layers * n_profiles_;
 	}
 
+	// Writes the k-point block, (energies) and (occupations) are given for all bands,
+	// (cs_sq) - for the selected ones only
 	void write_ldos(const Vec3<double>& k, const std::vector<double>& energies,
 		  			const std::vector<double>& occupations,
 					const Matrix<float>& cs_sq)
 	{
-		assert(energies.size() == n_bands_ && occupations.size() == n_bands_);
+		assert(n_energies_ == 0);
+		assert(energies.size() >= band_first_ + n_bands_ && occupations.size() >= band_first_ + n_bands_);
 		assert(cs_sq.rows() == n_layers_ && cs_sq.cols() == n_bands_);
 
+		begin_block();
 		write(k);
-		write(energies.data(), energies.size());
-		write(occupations.data(), occupations.size());
-		write(cs_sq.data(), cs_sq.size());
+		write(energies.data() + band_first_, n_bands_);
+		write(occupations.data() + band_first_, n_bands_);
+		write_chunked(cs_sq);
+		flush();
+	}
+
+	// Writes LDOS(E, z) of a k-point
+	void write_dos(const Vec3<double>& k, const Matrix<float>& dos)
+	{
+		assert(n_energies_ > 0);
+		assert(dos.rows() == n_layers_ && dos.cols() == n_energies_);
+
+		begin_block();
+		write(k);
+		write_chunked(dos);
+		flush();
+	}
+
+	// Writes LDOS(E, z) summed over k-points
+	void write_dos(const Matrix<float>& dos)
+	{
+		assert(n_energies_ > 0);
+		assert(dos.rows() == n_layers_ && dos.cols() == n_energies_);
+
+		begin_block();
+		write_chunked(dos);
+		flush();
+	}
+
+	// Writes charge density and partial charge density profiles of a spin projection,
+	// spin projections of each snapshot follow its blocks
+	void write_profiles(const Matrix<float>& profiles)
+	{
+		assert(profiles.rows() == n_layers_ && profiles.cols() == n_profiles_);
+		assert(profile_offsets_.size() < n_snapshots_ * n_spins_);
+
+		profile_offsets_.push_back(pos_);
+		write(profiles.data(), profiles.size());
+		flush();
+	}
+
+	// Makes the block (block) the next one to be written, so that processes can write
+	// blocks in any order; blocks should be of fixed size (not encoded)
+	void seek_block(std::size_t block)
+	{
+		assert(encoding_ == Ldos_encoding::FLOAT);
+		assert(block < n_blocks_);
+
+		pos_ = block_pos(block);
+		next_block_ = block;
+		is_seeking_ = true;
+	}
+
+	// Makes the profiles of the snapshot the next data to be written
+	void seek_profiles(std::size_t snapshot)
+	{
+		assert(encoding_ == Ldos_encoding::FLOAT);
+		assert(snapshot < n_snapshots_);
+
+		pos_ = blocks_pos_ + snapshot * snapshot_size_ + n_snapshot_blocks_ * block_size_;
+		is_seeking_ = true;
 	}
 
 	void write_minmax_values(double energy_min, double energy_max, float cs_sq_max)
 	{
-		assert(energy_min < energy_max);
+		assert(energy_min <= energy_max);
 
-		file_.seekp(minmax_values_pos_);
 	 	write(energy_min);
 	 	write(energy_max);
 	 	write(cs_sq_max);
+		flush_at(minmax_values_pos_);
+	}
+
+	// Writes offsets of the blocks and profiles written so far into the index,
+	// offsets of missing ones are zero; if blocks have been sought,
+	// all of them are assumed to be written by some process
+	void write_index()
+	{
+		auto index = block_offsets_;
+		if (is_seeking_)
+			for (std::size_t i = 0; i < n_blocks_; ++i)
+				index[i] = block_pos(i);
+
+		index.insert(index.end(), profile_offsets_.begin(), profile_offsets_.end());
+		index.resize(n_blocks_ + n_snapshots_ * n_spins_, 0);
+
+		write(index.data(), index.size());
+		flush_at(index_pos_);
+	}
+
+	// Hash of the header fields, identifies the output parameters
+	std::uint64_t header_hash() const
+	{
+		return header_hash_;
+	}
+
+	Ldos_writer_state state() const
+	{
+		return {pos_, next_block_, block_offsets_, profile_offsets_};
+	}
+
+	// Continues writing from the saved state
+	void restore(const Ldos_writer_state& state)
+	{
+		assert(state.next_block <= n_blocks_ && state.block_offsets.size() == n_blocks_);
+		assert(state.profile_offsets.size() <= n_snapshots_ * n_spins_);
+		assert(state.pos >= blocks_pos_);
+
+		pos_ = state.pos;
+		next_block_ = state.next_block;
+		block_offsets_ = state.block_offsets;
+		profile_offsets_ = state.profile_offsets;
+	}
+
+	// Passes written data to the operating system
+	void sync()
+	{
+		file_.flush();
 	}
 
 private:
+	// Checks that the existing file starts with the header in the buffer, except for
+	// the text of the first (length) bytes and the fields that are written at the end
+	void check_header(const std::string& filename, std::size_t length) const
+	{
+		const auto size = minmax_values_pos_ - length;
+		std::vector<char> header(size);
+
+		std::ifstream file(filename, std::ifstream::binary);
+		file.seekg(static_cast<std::streamoff>(length));
+		file.read(header.data(), static_cast<std::streamsize>(size));
+		if (!file || !std::equal(header.begin(), header.end(), buffer_.begin() + static_cast<std::ptrdiff_t>(length)))
+			throw std::runtime_error("File '" + filename + "' does not match the run parameters");
+	}
+
+	// Data is collected in the buffer and then written to the file at once
 	template<typename T>
 	void write(const T& x)
 	{
-		file_.write(reinterpret_cast<const char*>(&x), sizeof(T));
+		write(&x, 1);
 	}
 
 	template<typename T>
-	void write(const T* buff, std::size_t count )
+	void write(const T* buff, std::size_t count)
+	{
+		const auto data = reinterpret_cast<const char*>(buff);
+		buffer_.insert(buffer_.end(), data, data + sizeof(T) * count);
+	}
+
+	// Writes the buffer at the current position and advances it,
+	// the buffer is skipped if (is_written) is false
+	void flush(bool is_written = true)
+	{
+		if (is_written)
+			file_.write_at(pos_, buffer_.data(), buffer_.size());
+		pos_ += buffer_.size();
+		buffer_.clear();
+	}
+
+	// Writes the buffer at (pos), the current position is not changed
+	void flush_at(std::uint64_t pos)
 	{
-		file_.write(reinterpret_cast<const char*>(buff), sizeof(T) * count);
+		file_.write_at(pos, buffer_.data(), buffer_.size());
+		buffer_.clear();
+	}
+
+	// Position of the block if blocks are not encoded
+	std::uint64_t block_pos(std::size_t block) const
+	{
+		return blocks_pos_ + block / n_snapshot_blocks_ * snapshot_size_ + block % n_snapshot_blocks_ * block_size_;
+	}
+
+	static std::size_t chunk_size(std::size_t chunk, std::size_t size)
+	{
+		return (chunk == 0) ? size : std::min(chunk, size);
+	}
+
+	void begin_block()
+	{
+		assert(next_block_ < n_blocks_);
+		block_offsets_[next_block_++] = pos_;
+	}
+
+	// Writes the matrix by chunks of (layer_chunk_) rows and (column_chunk_) columns,
+	// the chunks of each group of columns follow each other, each chunk being column-major;
+	// encoded chunks are preceded by the table of their sizes in bytes
+	void write_chunked(const Matrix<float>& m)
+	{
+		const auto n_row_chunks = (m.rows() + layer_chunk_ - 1) / layer_chunk_;
+		const auto n_chunks = n_row_chunks * ((m.cols() + column_chunk_ - 1) / column_chunk_);
+
+		// Copies the chunk into (values)
+		const auto get_chunk = [&](std::size_t chunk, std::vector<float>& values)
+		{
+			const auto col_first = chunk / n_row_chunks * column_chunk_;
+			const auto col_last = std::min(col_first + column_chunk_, m.cols());
+			const auto row_first = chunk % n_row_chunks * layer_chunk_;
+			const auto n_rows = std::min(layer_chunk_, m.rows() - row_first);
+
+			values.clear();
+			for (auto col = col_first; col < col_last; ++col)
+				values.insert(values.end(), &m(row_first, col), &m(row_first, col) + n_rows);
+		};
+
+		if (encoding_ == Ldos_encoding::FLOAT)
+		{
+			std::vector<float> values;
+			for (std::size_t chunk = 0; chunk < n_chunks; ++chunk)
+			{
+				get_chunk(chunk, values);
+				write(values.data(), values.size());
+			}
+			return;
+		}
+
+		const auto threshold = threshold_ * *std::max_element(m.data(), m.data() + m.size());
+		const auto n_threads = std::min(n_threads_, n_chunks);
+
+		std::vector<std::vector<unsigned char>> chunks(n_chunks);
+		run_parallel(n_threads, [&](std::size_t thread)
+		{
+			std::vector<float> values;
+			for (auto chunk = thread; chunk < n_chunks; chunk += n_threads)
+			{
+				get_chunk(chunk, values);
+				encode_ldos_chunk(encoding_, values.data(), values.size(), threshold, chunks[chunk]);
+			}
+		});
+
+		for (const auto& chunk : chunks)
+			write(static_cast<std::uint32_t>(chunk.size()));
+		for (const auto& chunk : chunks)
+			write(chunk.data(), chunk.size());
 	}
 
 	static std::string date_time_string()
@@ -109,9 +430,34 @@ private:
 	}
 
 private:
-	std::ofstream file_;
-	std::streampos minmax_values_pos_;
-
+	const std::size_t band_first_;
 	const std::size_t n_bands_;
 	const std::size_t n_layers_;
+	const std::size_t n_energies_;
+	const std::size_t n_profiles_;
+	const std::size_t n_spins_;
+	const std::size_t n_snapshots_;
+	const std::size_t n_snapshot_blocks_;		// Number of blocks of each snapshot
+	const std::size_t n_blocks_;
+	const std::size_t layer_chunk_;
+	const std::size_t column_chunk_;
+	const Ldos_encoding encoding_;
+	const float threshold_;
+	const std::size_t n_threads_;
+
+	Output_file file_;
+	std::vector<char> buffer_;
+	std::uint64_t pos_ = 0;				// File position the buffer is written at
+
+	std::uint64_t header_hash_;
+	std::uint64_t minmax_values_pos_;
+	std::uint64_t index_pos_;
+	std::uint64_t blocks_pos_;
+	std::size_t block_size_;			// Sizes of blocks and snapshots in bytes if blocks are not encoded
+	std::size_t snapshot_size_;
+
+	std::vector<std::uint64_t> block_offsets_;
+	std::vector<std::uint64_t> profile_offsets_;
+	std::size_t next_block_ = 0;
+	bool is_seeking_ = false;
 };
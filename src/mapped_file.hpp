@@ -0,0 +1,80 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// Read-only memory-mapped file
+class Mapped_file
+{
+public:
+	Mapped_file(const std::string& filename)
+	{
+		const auto fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open file '" + filename + "'");
+
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Cannot get size of file '" + filename + "'");
+		}
+
+		size_ = static_cast<std::size_t>(st.st_size);
+		auto data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (data == MAP_FAILED)
+			throw std::runtime_error("Cannot memory-map file '" + filename + "'");
+
+		data_ = static_cast<const char*>(data);
+		::madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+	}
+
+	~Mapped_file()
+	{
+		::munmap(const_cast<char*>(data_), size_);
+	}
+
+	Mapped_file(const Mapped_file&) = delete;
+	Mapped_file& operator=(const Mapped_file&) = delete;
+
+	const char* data() const
+	{
+		return data_;
+	}
+
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+	// Asks the kernel to start reading the range [offset, offset + length) in advance
+	void will_need(std::size_t offset, std::size_t length) const
+	{
+		static const auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+
+		const auto first = offset / page_size * page_size;
+		if (first >= size_)
+			return;
+
+		const auto last = std::min(offset + length, size_);
+		::madvise(const_cast<char*>(data_ + first), last - first, MADV_WILLNEED);
+	}
+
+	// Tells the kernel that pages are accessed in random order, so that it does not read ahead
+	void advise_random() const
+	{
+		::madvise(const_cast<char*>(data_), size_, MADV_RANDOM);
+	}
+
+private:
+	const char* data_;
+	std::size_t size_;
+};
@@ -1,22 +1,109 @@
 #pragma once
 #include <algorithm>
-#include <vector>
+#include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <memory>
 #include <new>
-#include <cassert>
+#include <type_traits>
 
-// Simple class for column-major matricies
+// Non-owning view of a column-major matrix with
+// the distance between columns (ld) in elements
+template<typename T>
+class Matrix_view
+{
+public:
+	Matrix_view() = default;
+
+	Matrix_view(T* data, std::size_t rows, std::size_t cols, std::size_t ld)
+		: data_(data), rows_(rows), cols_(cols), ld_(ld)
+	{
+		assert(ld_ >= rows_);
+	}
+
+	// Views of mutable elements convert into views of const ones
+	template<typename U, typename = std::enable_if_t<std::is_same_v<const U, T>>>
+	Matrix_view(const Matrix_view<U>& other)
+		: Matrix_view(other.data(), other.rows(), other.cols(), other.ld())
+	{}
+
+	std::size_t rows() const
+	{
+		return rows_;
+	}
+
+	std::size_t cols() const
+	{
+		return cols_;
+	}
+
+	std::size_t ld() const
+	{
+		return ld_;
+	}
+
+	T& operator()(std::size_t row, std::size_t col) const
+	{
+		assert(row < rows_);
+		assert(col < cols_);
+
+		return data_[row + col * ld_];
+	}
+
+	T* data() const
+	{
+		return data_;
+	}
+
+private:
+	T* data_ = nullptr;
+
+	std::size_t rows_ = 0;
+	std::size_t cols_ = 0;
+	std::size_t ld_ = 0;
+};
+
+// Simple class for column-major matricies; the storage is aligned for SIMD loads and FFT codelets,
+// and is not initialized: elements are to be written before they are read
 template<typename T>
 class Matrix
 {
+	static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>,
+				  "Bad data type");
+
+public:
+	static constexpr std::size_t alignment = 64;
+
 public:
 	Matrix() = default;
 
 	Matrix(std::size_t rows, std::size_t cols)
-		: rows_(rows), cols_(cols)
 	{
-		data_.resize(rows_ * cols_);
+		resize(rows, cols);
+	}
+
+	Matrix(const Matrix& other)
+	{
+		if (other.size() == 0)
+			return;
+
+		resize(other.rows_, other.cols_);
+		std::copy_n(other.data(), size(), data());
+	}
+
+	Matrix(Matrix&& other) noexcept
+		: data_(std::move(other.data_)), capacity_(other.capacity_), rows_(other.rows_), cols_(other.cols_)
+	{
+		other.capacity_ = other.rows_ = other.cols_ = 0;
+	}
+
+	Matrix& operator=(Matrix other) noexcept
+	{
+		std::swap(data_, other.data_);
+		std::swap(capacity_, other.capacity_);
+		std::swap(rows_, other.rows_);
+		std::swap(cols_, other.cols_);
+		return *this;
 	}
 
 	std::size_t rows() const
@@ -34,13 +121,26 @@ public:
 		return rows_ * cols_;
 	}
 
+	// Number of elements the matrix can hold without reallocation
+	std::size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	// Memory is reallocated only if the new size exceeds the capacity;
+	// elements are not preserved in either case
 	void resize(std::size_t rows, std::size_t cols)
 	{
 		assert(rows > 0 && cols > 0);
 
 		rows_ = rows;
 		cols_ = cols;
-		data_.resize(rows_ * cols_);
+		if (size() > capacity_)
+		{
+			data_.reset();
+			data_.reset(static_cast<T*>(::operator new(size() * sizeof(T), std::align_val_t(alignment))));
+			capacity_ = size();
+		}
 	}
 
 	T& operator()(std::size_t row, std::size_t col)
@@ -48,7 +148,7 @@ public:
 		assert(row < rows_);
 		assert(col < cols_);
 
-		return data_[row + col * rows_];
+		return data_.get()[row + col * rows_];
 	}
 
 	const T& operator()(std::size_t row, std::size_t col) const
@@ -56,26 +156,45 @@ public:
 		assert(row < rows_);
 		assert(col < cols_);
 
-		return data_[row + col * rows_];
+		return data_.get()[row + col * rows_];
 	}
 
 	T* data()
 	{
-		return data_.data();
+		return data_.get();
 	}
 
 	const T* data() const
 	{
-		return data_.data();
+		return data_.get();
+	}
+
+	Matrix_view<T> view()
+	{
+		return {data(), rows_, cols_, rows_};
+	}
+
+	Matrix_view<const T> view() const
+	{
+		return {data(), rows_, cols_, rows_};
 	}
 
 	void fill(const T& value)
 	{
-		std::fill(data_.begin(), data_.end(), value);
+		std::fill_n(data(), size(), value);
 	}
 
 private:
-	std::vector<T> data_;
+	struct Deleter
+	{
+		void operator()(T* data) const
+		{
+			::operator delete(data, std::align_val_t(alignment));
+		}
+	};
+
+	std::unique_ptr<T, Deleter> data_;
+	std::size_t capacity_ = 0;
 
 	std::size_t rows_ = 0;
 	std::size_t cols_ = 0;
@@ -0,0 +1,170 @@
+#pragma once
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	#define HAVE_X86_SIMD
+	#include <immintrin.h>
+#endif
+
+// Kernels computing sq[i] = |c[i]|^2, adding (weight * sq[i]) to (sum[i]) and returning
+// max(max, sq[i]), i in [0, n); vector ones keep the running maximum in registers,
+// and the one for the current CPU is selected at runtime
+template<typename T>
+using Norm_sq_kernel = float (*)(const std::complex<T>* c, std::size_t n, float weight, float* sum, float max);
+
+template<typename T>
+float accumulate_norm_sq_scalar(const std::complex<T>* c, std::size_t n, float weight, float* sum, float max)
+{
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const auto sq = static_cast<float>(std::norm(c[i]));
+		max = std::max(max, sq);
+		sum[i] += weight * sq;
+	}
+
+	return max;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+inline float horizontal_max(__m256 x)
+{
+	auto m = _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+	m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_max_ss(m, _mm_movehdup_ps(m));
+	return _mm_cvtss_f32(m);
+}
+
+__attribute__((target("avx2,fma")))
+inline float accumulate_norm_sq_avx2(const std::complex<float>* c, std::size_t n, float weight, float* sum, float max)
+{
+	const auto data = reinterpret_cast<const float*>(c);
+	const auto w = _mm256_set1_ps(weight);
+	auto m = _mm256_set1_ps(max);
+
+	std::size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		const auto a = _mm256_loadu_ps(data + 2 * i);
+		const auto b = _mm256_loadu_ps(data + 2 * i + 8);
+
+		// Pairwise sums come in the order 0, 1, 4, 5, 2, 3, 6, 7
+		const auto h = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+		const auto sq = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(h), 0b11'01'10'00));
+
+		m = _mm256_max_ps(m, sq);
+		_mm256_storeu_ps(sum + i, _mm256_fmadd_ps(w, sq, _mm256_loadu_ps(sum + i)));
+	}
+
+	return accumulate_norm_sq_scalar(c + i, n - i, weight, sum + i, horizontal_max(m));
+}
+
+__attribute__((target("avx2,fma")))
+inline float accumulate_norm_sq_avx2(const std::complex<double>* c, std::size_t n, float weight, float* sum, float max)
+{
+	const auto data = reinterpret_cast<const double*>(c);
+	const auto w = _mm_set1_ps(weight);
+	auto m = _mm_set1_ps(max);
+
+	std::size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		const auto a = _mm256_loadu_pd(data + 2 * i);
+		const auto b = _mm256_loadu_pd(data + 2 * i + 4);
+
+		// Pairwise sums come in the order 0, 2, 1, 3
+		const auto h = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+		const auto sq = _mm256_cvtpd_ps(_mm256_permute4x64_pd(h, 0b11'01'10'00));
+
+		m = _mm_max_ps(m, sq);
+		_mm_storeu_ps(sum + i, _mm_fmadd_ps(w, sq, _mm_loadu_ps(sum + i)));
+	}
+
+	m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_max_ss(m, _mm_movehdup_ps(m));
+	return accumulate_norm_sq_scalar(c + i, n - i, weight, sum + i, _mm_cvtss_f32(m));
+}
+
+// Some GCC versions warn about the uninitialized values AVX-512 intrinsics are built on
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float accumulate_norm_sq_avx512(const std::complex<float>* c, std::size_t n, float weight, float* sum, float max)
+{
+	const auto data = reinterpret_cast<const float*>(c);
+	const auto w = _mm512_set1_ps(weight);
+	const auto even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const auto odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+	auto m = _mm512_set1_ps(max);
+
+	std::size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		const auto a = _mm512_loadu_ps(data + 2 * i);
+		const auto b = _mm512_loadu_ps(data + 2 * i + 16);
+
+		const auto re = _mm512_permutex2var_ps(a, even, b);
+		const auto im = _mm512_permutex2var_ps(a, odd, b);
+		const auto sq = _mm512_fmadd_ps(re, re, _mm512_mul_ps(im, im));
+
+		m = _mm512_max_ps(m, sq);
+		_mm512_storeu_ps(sum + i, _mm512_fmadd_ps(w, sq, _mm512_loadu_ps(sum + i)));
+	}
+
+	return accumulate_norm_sq_avx2(c + i, n - i, weight, sum + i, _mm512_reduce_max_ps(m));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float accumulate_norm_sq_avx512(const std::complex<double>* c, std::size_t n, float weight, float* sum, float max)
+{
+	const auto data = reinterpret_cast<const double*>(c);
+	const auto w = _mm256_set1_ps(weight);
+	const auto even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+	const auto odd = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+	auto m = _mm256_set1_ps(max);
+
+	std::size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		const auto a = _mm512_loadu_pd(data + 2 * i);
+		const auto b = _mm512_loadu_pd(data + 2 * i + 8);
+
+		const auto re = _mm512_permutex2var_pd(a, even, b);
+		const auto im = _mm512_permutex2var_pd(a, odd, b);
+		const auto sq = _mm512_cvtpd_ps(_mm512_fmadd_pd(re, re, _mm512_mul_pd(im, im)));
+
+		m = _mm256_max_ps(m, sq);
+		_mm256_storeu_ps(sum + i, _mm256_fmadd_ps(w, sq, _mm256_loadu_ps(sum + i)));
+	}
+
+	return accumulate_norm_sq_avx2(c + i, n - i, weight, sum + i, horizontal_max(m));
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+// Returns the fastest kernel supported by the CPU
+template<typename T>
+Norm_sq_kernel<T> norm_sq_kernel()
+{
+#ifdef HAVE_X86_SIMD
+	static const auto kernel = []() -> Norm_sq_kernel<T>
+	{
+		if (__builtin_cpu_supports("avx512f"))
+			return accumulate_norm_sq_avx512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return accumulate_norm_sq_avx2;
+		return accumulate_norm_sq_scalar<T>;
+	}();
+
+	return kernel;
+#else
+	return accumulate_norm_sq_scalar<T>;
+#endif
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "distributed.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// Binary output file written at given offsets; with MPI, it is opened by all processes
+// and each of them writes its own parts; an existing file is either truncated or continued
+class Output_file
+{
+public:
+	Output_file(const std::string& filename, bool is_truncated = true)
+	{
+#ifdef HAVE_MPI
+		if (n_processes() > 1)
+		{
+			auto status = MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+				MPI_INFO_NULL, &mpi_file_);
+			if (status == MPI_SUCCESS && is_truncated)
+				status = MPI_File_set_size(mpi_file_, 0);
+			if (status != MPI_SUCCESS)
+				throw std::runtime_error("File '" + filename + "' cannot be opened for writing");
+			return;
+		}
+#endif
+		file_.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		if (is_truncated)
+			file_.open(filename, std::ofstream::binary);
+		else
+			file_.open(filename, std::ofstream::binary | std::ofstream::in | std::ofstream::out);
+	}
+
+#ifdef HAVE_MPI
+	~Output_file()
+	{
+		if (mpi_file_ != MPI_FILE_NULL)
+			MPI_File_close(&mpi_file_);
+	}
+#endif
+
+	Output_file(const Output_file&) = delete;
+	Output_file& operator=(const Output_file&) = delete;
+
+	void write_at(std::uint64_t offset, const char* data, std::size_t size)
+	{
+#ifdef HAVE_MPI
+		if (mpi_file_ != MPI_FILE_NULL)
+		{
+			// Counts are limited to int
+			while (size > 0)
+			{
+				const auto count = std::min<std::size_t>(size, std::numeric_limits<int>::max());
+				if (MPI_File_write_at(mpi_file_, static_cast<MPI_Offset>(offset), data, static_cast<int>(count),
+					MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+					throw std::runtime_error("File write failed");
+
+				offset += count;
+				data += count;
+				size -= count;
+			}
+			return;
+		}
+#endif
+		file_.seekp(static_cast<std::streamoff>(offset));
+		file_.write(data, static_cast<std::streamsize>(size));
+	}
+
+	// With MPI, writes are not buffered by the process
+	void flush()
+	{
+		if (file_.is_open())
+			file_.flush();
+	}
+
+private:
+	std::ofstream file_;
+#ifdef HAVE_MPI
+	MPI_File mpi_file_ = MPI_FILE_NULL;
+#endif
+};
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Bands and k-points to be processed, the same bands
+// are taken for all k-points and spin projections
+struct Selection
+{
+	std::size_t band_first;
+	std::size_t n_bands;
+	std::vector<std::size_t> kpoints;	// Zero-based k-point indices in increasing order
+};
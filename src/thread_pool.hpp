@@ -0,0 +1,173 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a three-stage pipeline over items [0, n) using (n_slots) slots of data:
+// read(i, slot) is called in increasing order of i on a dedicated thread,
+// compute(worker, i, slot) - on (n_workers) threads, and write(i, slot) -
+// in increasing order of i on the calling thread; the slot (i % n_slots) is owned
+// by the item i from the beginning of read(...) till the end of write(...)
+template<class Read, class Compute, class Write>
+void run_pipeline(std::size_t n, std::size_t n_workers, std::size_t n_slots,
+				  Read&& read, Compute&& compute, Write&& write)
+{
+	assert(n_workers > 0);
+	assert(n_slots > 0);
+
+	enum class State
+	{
+		FREE,
+		READ,
+		COMPUTING,
+		COMPUTED
+	};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<State> states(n_slots, State::FREE);
+	std::size_t next_compute = 0;
+	std::exception_ptr error;
+
+	const auto set_error = [&]
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error)
+			error = std::current_exception();
+		cv.notify_all();
+	};
+
+	const auto set_state = [&](std::size_t slot, State state)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		states[slot] = state;
+		cv.notify_all();
+	};
+
+	const auto reader_fn = [&]
+	{
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			const auto slot = i % n_slots;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return error || states[slot] == State::FREE; });
+				if (error)
+					return;
+			}
+
+			try
+			{
+				read(i, slot);
+			}
+			catch (...)
+			{
+				set_error();
+				return;
+			}
+
+			set_state(slot, State::READ);
+		}
+	};
+
+	const auto worker_fn = [&](std::size_t worker)
+	{
+		for (;;)
+		{
+			std::size_t i;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]
+					{ return error || next_compute >= n || states[next_compute % n_slots] == State::READ; });
+				if (error || next_compute >= n)
+					return;
+				i = next_compute++;
+				states[i % n_slots] = State::COMPUTING;
+			}
+
+			try
+			{
+				compute(worker, i, i % n_slots);
+			}
+			catch (...)
+			{
+				set_error();
+				return;
+			}
+
+			set_state(i % n_slots, State::COMPUTED);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.emplace_back(reader_fn);
+	for (std::size_t w = 0; w < std::min(n_workers, n); ++w)
+		threads.emplace_back(worker_fn, w);
+
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const auto slot = i % n_slots;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&] { return error || states[slot] == State::COMPUTED; });
+			if (error)
+				break;
+		}
+
+		try
+		{
+			write(i, slot);
+		}
+		catch (...)
+		{
+			set_error();
+			break;
+		}
+
+		set_state(slot, State::FREE);
+	}
+
+	for (auto& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+// Calls fn(thread) for all thread in [0, n_threads) concurrently, the calling
+// thread being used as the thread 0; the first exception thrown is rethrown
+template<class Fn>
+void run_parallel(std::size_t n_threads, Fn&& fn)
+{
+	assert(n_threads > 0);
+
+	std::vector<std::exception_ptr> errors(n_threads);
+	const auto thread_fn = [&](std::size_t thread)
+	{
+		try
+		{
+			fn(thread);
+		}
+		catch (...)
+		{
+			errors[thread] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (std::size_t t = 1; t < n_threads; ++t)
+		threads.emplace_back(thread_fn, t);
+
+	thread_fn(0);
+	for (auto& thread : threads)
+		thread.join();
+
+	for (auto& error : errors)
+		if (error)
+			std::rethrow_exception(error);
+}
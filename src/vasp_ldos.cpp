@@ -1,24 +1,38 @@
 #include "command_line.hpp"
+#include "depth_grid.hpp"
+#include "distributed.hpp"
+#include "energy_grid.hpp"
+#include "fft.hpp"
+#include "journal.hpp"
 #include "ldos_writer.hpp"
 #include "matrix.hpp"
+#include "norm_sq.hpp"
+#include "selection.hpp"
+#include "thread_pool.hpp"
+#include "vec3.hpp"
 #include "wavecar_reader.hpp"
 
-#ifdef USE_MKL_FFT
-	#include "fft_mkl.hpp"
-#else
-	#include "fft_fftw.hpp"
-#endif
+#include <glob.h>
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <complex>
 #include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
 
 enum class Cell_direction
 {
@@ -31,6 +45,7 @@ struct Fft_size
 	std::size_t n_transforms;
 };
 
+// Returns the direction of the longest lattice vector
 Cell_direction get_direction(const Wavecar_reader& reader)
 {
 	if (reader.a0_norm() > reader.a1_norm() && reader.a0_norm() > reader.a2_norm())
@@ -40,7 +55,7 @@ Cell_direction get_direction(const Wavecar_reader& reader)
 	else if (reader.a2_norm() > reader.a0_norm() && reader.a2_norm() > reader.a1_norm())
 		return Cell_direction::A2;
 	else
-		throw std::runtime_error("Bad supercell size");
+		throw std::runtime_error("Bad supercell size, no lattice vector is the longest one; use --directions");
 }
 
 double get_height(const Wavecar_reader& wc_reader, Cell_direction dir)
@@ -58,7 +73,7 @@ double get_height(const Wavecar_reader& wc_reader, Cell_direction dir)
 	}
 }
 
-Fft_size get_fft_size(Wavecar_reader& wc_reader, Cell_direction dir)
+Fft_size get_fft_size(const Wavecar_reader& wc_reader, Cell_direction dir)
 {
 	switch (dir)
 	{
@@ -73,97 +88,1323 @@ Fft_size get_fft_size(Wavecar_reader& wc_reader, Cell_direction dir)
 	}
 }
 
-template<typename T>
-void map_g_sphere_to_fft_blocks(const Wavecar_reader& wc_reader,
-								Matrix<std::complex<T>>& cs,
-                                const Kpoint_data<T>& kpoint_data,
-								std::size_t band, Cell_direction dir)
+// Layout of non-empty G|| columns of the FFT box for a given k-point
+struct Fft_layout
 {
-	cs.fill(0);
+	// Offsets with this bit set receive conjugated coefficients
+	static constexpr std::uint32_t conj_flag = std::uint32_t{1} << 31;
 
-	switch (dir)
+	std::size_t n_columns;
+	std::vector<std::uint32_t> offsets;		// Linear offsets of plane waves in the compacted box
+
+	// For Gamma-only files, of each pair of G|| columns related by c(-G) = c*(G) only one
+	// is transformed and stands for both, (column_weights) being 2, or 1 for the G|| = 0 column;
+	// the G|| = 0 column gets both c(G) and c*(G) at -G, the latter given by (conj_extras),
+	// which are pairs of plane wave indices and offsets
+	std::vector<float> column_weights;
+	std::vector<std::pair<std::uint32_t, std::uint32_t>> conj_extras;
+};
+
+// Returns the index of a G vector component along the supercell direction
+// and the index of its G|| column in the FFT box
+template<Cell_direction dir>
+std::pair<std::size_t, std::size_t> fft_box_index(const Wavecar_reader& wc_reader, const Vec3<std::size_t>& g)
+{
+	if constexpr (dir == Cell_direction::A0)
+		return {g[0], g[1] + g[2] * wc_reader.size_g1()};
+	else if constexpr (dir == Cell_direction::A1)
+		return {g[1], g[2] + g[0] * wc_reader.size_g2()};
+	else
+		return {g[2], g[0] + g[1] * wc_reader.size_g0()};
+}
+
+// Returns G-lattice indices of -G
+Vec3<std::size_t> minus_g(const Wavecar_reader& wc_reader, const Vec3<std::size_t>& g)
+{
+	const auto minus = [](std::size_t i, std::size_t size) { return i == 0 ? 0 : size - i; };
+	return {minus(g[0], wc_reader.size_g0()), minus(g[1], wc_reader.size_g1()), minus(g[2], wc_reader.size_g2())};
+}
+
+template<Cell_direction dir, typename T>
+void get_fft_layout(const Wavecar_reader& wc_reader, const Kpoint_data<T>& kpoint_data, Fft_layout& layout)
+{
+	constexpr auto empty = static_cast<std::size_t>(-1);
+
+	const auto fft_size = get_fft_size(wc_reader, dir);
+	if (fft_size.size * fft_size.n_transforms >= Fft_layout::conj_flag)
+		throw std::runtime_error("FFT box is too large");
+
+	const auto& gs = *kpoint_data.gs;
+	const auto is_gamma_only = wc_reader.is_gamma_only();
+	if (is_gamma_only && (kpoint_data.n_plane_waves == 0 || gs[0][0] != 0 || gs[0][1] != 0 || gs[0][2] != 0))
+		throw std::runtime_error("Gamma-only WAVECAR does not start with G = 0");
+
+	// Of each pair of G|| and -G|| columns of Gamma-only files, the one
+	// with the smaller index is transformed
+	std::vector<std::size_t> column_index(fft_size.n_transforms, empty);
+	for (std::size_t ipw = 0; ipw < kpoint_data.n_plane_waves; ++ipw)
+	{
+		const auto ip = fft_box_index<dir>(wc_reader, gs[ipw]).second;
+		if (is_gamma_only)
+			column_index[std::min(ip, fft_box_index<dir>(wc_reader, minus_g(wc_reader, gs[ipw])).second)] = 0;
+		else
+			column_index[ip] = 0;
+	}
+
+	layout.n_columns = 0;
+	for (auto& index : column_index)
+		if (index != empty)
+			index = layout.n_columns++;
+
+	layout.offsets.resize(kpoint_data.n_plane_waves);
+	layout.column_weights.clear();
+	layout.conj_extras.clear();
+
+	if (!is_gamma_only)
 	{
-	case Cell_direction::A0:
 		for (std::size_t ipw = 0; ipw < kpoint_data.n_plane_waves; ++ipw)
 		{
-			const auto& g = kpoint_data.gs[ipw];
-			const auto g_parallel_index = g[1] + g[2] * wc_reader.size_g1();
-			cs(g[0], g_parallel_index) = kpoint_data.coeffs(ipw, band);
+			const auto [il, ip] = fft_box_index<dir>(wc_reader, gs[ipw]);
+			layout.offsets[ipw] = static_cast<std::uint32_t>(il + column_index[ip] * fft_size.size);
 		}
-		break;
+		return;
+	}
 
-	case Cell_direction::A1:
-		for (std::size_t ipw = 0; ipw < kpoint_data.n_plane_waves; ++ipw)
+	layout.column_weights.resize(layout.n_columns, 2);
+	for (std::size_t ipw = 0; ipw < kpoint_data.n_plane_waves; ++ipw)
+	{
+		const auto [il, ip] = fft_box_index<dir>(wc_reader, gs[ipw]);
+		const auto [minus_il, minus_ip] = fft_box_index<dir>(wc_reader, minus_g(wc_reader, gs[ipw]));
+
+		if (ip <= minus_ip)
+			layout.offsets[ipw] = static_cast<std::uint32_t>(il + column_index[ip] * fft_size.size);
+		else
+			layout.offsets[ipw] = static_cast<std::uint32_t>(minus_il + column_index[minus_ip] * fft_size.size) |
+				Fft_layout::conj_flag;
+
+		if (ip == minus_ip)
 		{
-			const auto& g = kpoint_data.gs[ipw];
-			const auto g_parallel_index = g[2] + g[0] * wc_reader.size_g2();
-			cs(g[1], g_parallel_index) = kpoint_data.coeffs(ipw, band);
+			layout.column_weights[column_index[ip]] = 1;
+			if (il != minus_il)
+				layout.conj_extras.emplace_back(static_cast<std::uint32_t>(ipw),
+					static_cast<std::uint32_t>(minus_il + column_index[ip] * fft_size.size));
 		}
+	}
+}
+
+template<typename T>
+void get_fft_layout(const Wavecar_reader& wc_reader, const Kpoint_data<T>& kpoint_data,
+					Cell_direction dir, Fft_layout& layout)
+{
+	switch (dir)
+	{
+	case Cell_direction::A0:
+		get_fft_layout<Cell_direction::A0>(wc_reader, kpoint_data, layout);
+		break;
+
+	case Cell_direction::A1:
+		get_fft_layout<Cell_direction::A1>(wc_reader, kpoint_data, layout);
 		break;
 
 	case Cell_direction::A2:
-		for (std::size_t ipw = 0; ipw < kpoint_data.n_plane_waves; ++ipw)
+		get_fft_layout<Cell_direction::A2>(wc_reader, kpoint_data, layout);
+	}
+}
+
+// Calls fn(offset, c) for each coefficient (c) of a band and its
+// offset in the compacted FFT box, including conjugated ones
+template<typename T, class Fn>
+void for_each_box_coeff(const Fft_layout& layout, const std::complex<T>* coeffs, Fn fn)
+{
+	const auto offsets = layout.offsets.data();
+	const auto n_plane_waves = layout.offsets.size();
+
+	if (layout.column_weights.empty())
+	{
+		for (std::size_t ipw = 0; ipw < n_plane_waves; ++ipw)
+			fn(offsets[ipw], coeffs[ipw]);
+		return;
+	}
+
+	// Gamma-only files store sqrt(2) c(G) for G != 0; G = 0 is the first plane wave
+	// and is stored as is, it is never conjugated and has no conjugated extra
+	const auto inv_sqrt2 = static_cast<T>(1 / std::sqrt(2.));
+
+	fn(offsets[0], coeffs[0]);
+	for (std::size_t ipw = 1; ipw < n_plane_waves; ++ipw)
+		if (offsets[ipw] & Fft_layout::conj_flag)
+			fn(offsets[ipw] & ~Fft_layout::conj_flag, inv_sqrt2 * std::conj(coeffs[ipw]));
+		else
+			fn(offsets[ipw], inv_sqrt2 * coeffs[ipw]);
+
+	for (const auto& [ipw, offset] : layout.conj_extras)
+		fn(offset, inv_sqrt2 * std::conj(coeffs[ipw]));
+}
+
+// Maps band coefficients onto the zero-filled compacted FFT box,
+// converting them to the FFT precision
+template<typename T, typename F>
+void map_g_sphere_to_fft_blocks(const Fft_layout& layout, const std::complex<F>* coeffs, std::complex<T>* box)
+{
+	for_each_box_coeff(layout, coeffs,
+		[box](std::uint32_t offset, std::complex<F> c) { box[offset] = static_cast<std::complex<T>>(c); });
+}
+
+// Maximum size of the FFT buffer of a thread used to transform several bands at once
+constexpr std::size_t fft_batch_memory = 64 << 20;
+
+// Number of columns of a single FFT plan; the plan is executed over consecutive
+// chunks of the buffer, so its shape does not depend on the number of non-empty
+// columns; the even number keeps all chunks aligned the same way for FFTW
+constexpr std::size_t fft_chunk_columns = 16;
+
+// Per-thread FFT data; only non-empty G|| columns are transformed,
+// (batch_size) bands being stored side by side and transformed at once
+template<typename T>
+struct Fft_data
+{
+	// The buffer is allocated for the full FFT box rounded up to whole chunks,
+	// and the plan is created once
+	Fft_data(const Fft_size& fft_size, std::size_t batch_size)
+		: batch_size(batch_size),
+		  cs(fft_size.size, (fft_size.n_transforms * batch_size + fft_chunk_columns - 1) /
+			  fft_chunk_columns * fft_chunk_columns),
+		  fft(cs.rows(), fft_chunk_columns, cs.data())
+	{}
+
+	// Zero-fills the first (n_columns) columns rounded up to whole chunks
+	void clear(std::size_t n_columns)
+	{
+		std::fill_n(cs.data(), chunked(n_columns) * cs.rows(), std::complex<T>{});
+	}
+
+	// Transforms the first (n_columns) columns rounded up to whole chunks
+	void transform(std::size_t n_columns)
+	{
+		for (std::size_t col = 0; col < chunked(n_columns); col += fft_chunk_columns)
+			fft.transform(&cs(0, col));
+	}
+
+	const std::size_t batch_size;
+	Matrix<std::complex<T>> cs;
+	const Fft<T> fft;
+
+private:
+	static std::size_t chunked(std::size_t n_columns)
+	{
+		return (n_columns + fft_chunk_columns - 1) / fft_chunk_columns * fft_chunk_columns;
+	}
+};
+
+// Direct evaluation of LDOS at the depths of (grid)
+template<typename T>
+struct Depth_data
+{
+	const Depth_grid& grid;
+	const Matrix<std::complex<T>> phases;
+};
+
+// Data of a k-point worker, bands of a k-point are split between (n_band_threads) threads;
+// if LDOS is evaluated at selected depths, no FFT data is allocated
+template<typename T>
+struct Worker
+{
+	Worker(const Fft_size& fft_size, std::size_t n_band_threads, std::size_t batch_size, bool has_depths)
+		: n_band_threads(n_band_threads)
+	{
+		if (has_depths)
+			depth_sums.resize(n_band_threads);
+		else
+			for (std::size_t i = 0; i < n_band_threads; ++i)
+				fft_data.push_back(std::make_unique<Fft_data<T>>(fft_size, batch_size));
+	}
+
+	const std::size_t n_band_threads;
+
+	std::shared_ptr<const G_sphere> layout_gs;		// G-sphere the (layout) has been computed for
+	Fft_layout layout;
+	std::vector<std::unique_ptr<Fft_data<T>>> fft_data;
+	std::vector<Matrix<std::complex<T>>> depth_sums;
+};
+
+// Window of bands of a k-point, a unit of the pipeline work
+struct Band_window
+{
+	std::size_t snapshot;
+	std::size_t block;		// Index of the (snapshot, spin, k-point) item
+	std::size_t item;		// Index of the item among those of this process
+	std::size_t spin;
+	std::size_t kpoint;
+	std::size_t band_first;
+	std::size_t n_bands;
+};
+
+// Results of processing a band window along a cell direction
+struct Window_results
+{
+	float cs_sq_max;
+	Matrix<float> dos;		// Contribution of the window bands to LDOS(E, z)
+	Matrix<float> profiles;	// Contribution of the window bands to charge density profiles
+};
+
+// Band window data on its way from the reader to the writer; the coefficients
+// are read once and processed along each cell direction
+template<typename T>
+struct Window_slot
+{
+	Kpoint_data<T> kpoint_data;
+	std::vector<Window_results> results;	// For each cell direction
+};
+
+// Computes the columns [band_first, band_last) of (cs_sq) and returns the maximum |c|^2 value,
+// band indices are relative to (kpoint_data.band_first), and the first column
+// of (cs_sq) corresponds to the band (cs_sq_band_first); (T) is the FFT precision,
+// (F) is the precision of coefficients in the file
+template<typename T, typename F>
+float process_bands(const Kpoint_data<F>& kpoint_data, const Fft_layout& layout, Fft_data<T>& fft_data,
+					std::size_t band_first, std::size_t band_last,
+					Matrix<float>& cs_sq, std::size_t cs_sq_band_first)
+{
+	assert(kpoint_data.band_first >= cs_sq_band_first);
+	const auto cs_sq_col = kpoint_data.band_first - cs_sq_band_first;
+
+	auto& cs = fft_data.cs;
+	const auto accumulate_norm_sq = norm_sq_kernel<T>();
+	auto cs_sq_max = -std::numeric_limits<float>::max();
+
+	for (auto ib = band_first; ib < band_last; ib += fft_data.batch_size)
+	{
+		const auto n_batch_bands = std::min(fft_data.batch_size, band_last - ib);
+		const auto n_columns = layout.n_columns * n_batch_bands;
+
+		fft_data.clear(n_columns);
+		for (std::size_t j = 0; j < n_batch_bands; ++j)
+			map_g_sphere_to_fft_blocks(layout, &kpoint_data.coeffs(0, ib + j), &cs(0, j * layout.n_columns));
+
+		fft_data.transform(n_columns);
+
+		// Sum over G||
+		for (std::size_t j = 0; j < n_batch_bands; ++j)
+			for (std::size_t ip = 0; ip < layout.n_columns; ++ip)
+			{
+				const auto weight = layout.column_weights.empty() ? 1.f : layout.column_weights[ip];
+				cs_sq_max = accumulate_norm_sq(&cs(0, j * layout.n_columns + ip), cs.rows(),
+											   weight, &cs_sq(0, cs_sq_col + ib + j), cs_sq_max);
+			}
+	}
+
+	return cs_sq_max;
+}
+
+// Same as process_bands(), but the sums over G along the supercell direction are evaluated
+// directly at the depth samples, (sums) being a buffer; the row (i) of (cs_sq) corresponds
+// to the depth (i) with LDOS averaged over its samples
+template<typename T, typename F>
+float process_bands_at_depths(const Kpoint_data<F>& kpoint_data, const Fft_layout& layout,
+							  const Depth_data<T>& depth_data, Matrix<std::complex<T>>& sums,
+							  std::size_t band_first, std::size_t band_last,
+							  Matrix<float>& cs_sq, std::size_t cs_sq_band_first)
+{
+	assert(kpoint_data.band_first >= cs_sq_band_first);
+	const auto cs_sq_col = kpoint_data.band_first - cs_sq_band_first;
+
+	const auto& grid = depth_data.grid;
+	const auto& phases = depth_data.phases;
+	const auto n_samples = phases.rows();
+	const auto fft_size = phases.cols();
+	auto cs_sq_max = -std::numeric_limits<float>::max();
+
+	sums.resize(n_samples, layout.n_columns);
+	for (auto ib = band_first; ib < band_last; ++ib)
+	{
+		sums.fill(0);
+		for_each_box_coeff(layout, &kpoint_data.coeffs(0, ib), [&](std::uint32_t offset, std::complex<F> c)
 		{
-			const auto& g = kpoint_data.gs[ipw];
-			const auto g_parallel_index = g[0] + g[1] * wc_reader.size_g0();
-			cs(g[2], g_parallel_index) = kpoint_data.coeffs(ipw, band);
+			const auto phase = &phases(0, offset % fft_size);
+			const auto sum = &sums(0, offset / fft_size);
+			const auto coeff = static_cast<std::complex<T>>(c);
+
+			for (std::size_t is = 0; is < n_samples; ++is)
+				sum[is] += coeff * phase[is];
+		});
+
+		// Sum over G||
+		for (std::size_t id = 0; id < grid.size(); ++id)
+		{
+			const auto [first, last] = grid.samples(id);
+
+			auto sq_sum = 0.f;
+			for (std::size_t ip = 0; ip < layout.n_columns; ++ip)
+			{
+				const auto weight = layout.column_weights.empty() ? 1.f : layout.column_weights[ip];
+				for (auto is = first; is < last; ++is)
+				{
+					const auto sq = static_cast<float>(std::norm(sums(is, ip)));
+					cs_sq_max = std::max(cs_sq_max, sq);
+					sq_sum += weight * sq;
+				}
+			}
+
+			cs_sq(id, cs_sq_col + ib) = sq_sum / static_cast<float>(last - first);
 		}
 	}
+
+	return cs_sq_max;
 }
 
+// Accumulates the layers [layer_first, layer_last) of the occupation-weighted charge density
+// (the first column of (profiles)) and of the partial charges of bands with energies
+// within (partial_windows) (the other columns) of the window bands
 template<typename T>
-void process(Wavecar_reader& reader, Ldos_writer& writer, Cell_direction dir)
+void accumulate_profiles(const Kpoint_data<T>& kpoint_data, const Matrix<float>& cs_sq, std::size_t cs_sq_col,
+						 const std::vector<std::pair<double, double>>& partial_windows,
+						 std::size_t layer_first, std::size_t layer_last, Matrix<float>& profiles)
 {
+	assert(profiles.cols() == partial_windows.size() + 1);
+
+	for (std::size_t ib = 0; ib < kpoint_data.coeffs.cols(); ++ib)
+	{
+		const auto energy = kpoint_data.energies[kpoint_data.band_first + ib];
+		const auto occupation = static_cast<float>(kpoint_data.occupations[kpoint_data.band_first + ib]);
+
+		for (auto il = layer_first; il < layer_last; ++il)
+			profiles(il, 0) += occupation * cs_sq(il, cs_sq_col + ib);
+
+		for (std::size_t iw = 0; iw < partial_windows.size(); ++iw)
+			if (energy >= partial_windows[iw].first && energy <= partial_windows[iw].second)
+				for (auto il = layer_first; il < layer_last; ++il)
+					profiles(il, iw + 1) += cs_sq(il, cs_sq_col + ib);
+	}
+}
+
+// Processes the window bands along the cell direction (dir), (worker) should be that of the direction
+template<typename T, typename F>
+void process_window(Worker<T>& worker, const Wavecar_reader& reader, Cell_direction dir,
+					const Kpoint_data<F>& kpoint_data, Window_results& results, Matrix<float>& cs_sq,
+					std::size_t cs_sq_band_first, const Depth_data<T>* depth_data, const Energy_grid* energy_grid,
+					const std::vector<std::pair<double, double>>& partial_windows)
+{
+	if (worker.layout_gs != kpoint_data.gs)
+	{
+		get_fft_layout(reader, kpoint_data, dir, worker.layout);
+		worker.layout_gs = kpoint_data.gs;
+	}
+
+	const auto n_bands = kpoint_data.coeffs.cols();
+	const auto first = &cs_sq(0, kpoint_data.band_first - cs_sq_band_first);
+	std::fill(first, first + cs_sq.rows() * n_bands, 0.f);
+
+	// Each band is a separate column of (cs_sq), so threads never write to the same element
+	const auto n_threads = worker.n_band_threads;
+	std::vector<float> cs_sq_max(n_threads);
+	run_parallel(n_threads, [&](std::size_t thread)
+	{
+		const auto band_first = n_bands * thread / n_threads;
+		const auto band_last = n_bands * (thread + 1) / n_threads;
+		if (depth_data)
+			cs_sq_max[thread] = process_bands_at_depths(kpoint_data, worker.layout, *depth_data,
+				worker.depth_sums[thread], band_first, band_last, cs_sq, cs_sq_band_first);
+		else
+			cs_sq_max[thread] = process_bands(kpoint_data, worker.layout, *worker.fft_data[thread],
+				band_first, band_last, cs_sq, cs_sq_band_first);
+	});
+
+	results.cs_sq_max = *std::max_element(cs_sq_max.begin(), cs_sq_max.end());
+
+	// Layers are split between threads
+	results.profiles.fill(0);
+	run_parallel(n_threads, [&](std::size_t thread)
+	{
+		const auto layer_first = cs_sq.rows() * thread / n_threads;
+		const auto layer_last = cs_sq.rows() * (thread + 1) / n_threads;
+		accumulate_profiles(kpoint_data, cs_sq, kpoint_data.band_first - cs_sq_band_first, partial_windows,
+			layer_first, layer_last, results.profiles);
+	});
+
+	// Energy grid points are split between threads
+	if (energy_grid)
+	{
+		results.dos.fill(0);
+		run_parallel(n_threads, [&](std::size_t thread)
+		{
+			const auto grid_first = energy_grid->size() * thread / n_threads;
+			const auto grid_last = energy_grid->size() * (thread + 1) / n_threads;
+			energy_grid->accumulate(kpoint_data.energies.data() + kpoint_data.band_first, n_bands,
+				cs_sq, kpoint_data.band_first - cs_sq_band_first, grid_first, grid_last, results.dos);
+		});
+	}
+}
+
+// Processing parameters given by the user
+struct Process_options
+{
+	std::size_t n_threads = 1;
+	std::size_t max_memory = 0;		// Approximate memory limit in bytes, zero if unlimited
+
+	// If set, LDOS(E, z) is computed on this grid instead of band-resolved LDOS,
+	// either for each k-point or summed over k-points with equal weights
+	std::optional<Energy_grid> energy_grid;
+	bool is_k_resolved = false;
+
+	// Energy windows of partial charge density profiles
+	std::vector<std::pair<double, double>> partial_windows;
+
+	// If not empty, LDOS is evaluated directly at these depths (in Angstroms)
+	// instead of all points of the FFT grid
+	std::vector<std::pair<double, double>> depths;
+
+	// If not empty, the fastest of these FFT backends is selected by timing the actual transform size
+	std::vector<Fft_backend> fft_backends_to_time;
+
+	// Layout of LDOS matrices in the output file
+	Ldos_format format;
+
+	// WAVECAR files of all snapshots (of the same geometry), the first one is that of the reader;
+	// if (is_combined) is true, they are written into one file, otherwise each into its own file
+	std::vector<std::string> snapshot_filenames;
+	bool is_combined = true;
+
+	// If not empty, progress is saved to this journal after each k-point, and
+	// if (is_resumed) is true, processing continues from the progress saved there
+	std::string journal_filename;
+	bool is_resumed = false;
+};
+
+// Computes LDOS of a sample of bands of the first selected k-point both in the FFT
+// precision (T) and in the file precision (F) and returns the maximum deviation
+// relative to the maximum LDOS value
+template<typename T, typename F>
+double sample_precision_deviation(Wavecar_reader& reader, Cell_direction dir, const Selection& selection,
+								  const Process_options& options)
+{
+	constexpr std::size_t max_sample_bands = 8;
+
 	const auto fft_size = get_fft_size(reader, dir);
+	const auto n_layers = options.depths.empty() ? fft_size.size : options.depths.size();
+	const auto n_bands = std::min(max_sample_bands, selection.n_bands);
 
-	Matrix<std::complex<T>> cs{fft_size.size, fft_size.n_transforms};
-	Matrix<float> cs_sq{fft_size.size, reader.n_bands()};
-	Kpoint_data<T> kpoint_data;
+	Kpoint_data<F> kpoint_data;
+	reader.get_kpoint_header(0, selection.kpoints.front(), kpoint_data);
+	reader.get_kpoint_bands(selection.band_first, n_bands, kpoint_data);
 
-	Fft<T> fft{fft_size.size, fft_size.n_transforms, cs.data()};
+	Window_results results;
+	results.profiles.resize(n_layers, 1);
 
-	auto energy_min = std::numeric_limits<double>::max();
-	auto energy_max = -std::numeric_limits<double>::max();
-	auto cs_sq_max = -std::numeric_limits<float>::max();
+	const auto compute = [&](auto precision)
+	{
+		using P = decltype(precision);
+
+		std::optional<Depth_grid> depth_grid;
+		std::optional<Depth_data<P>> depth_data;
+		if (!options.depths.empty())
+		{
+			depth_grid.emplace(get_height(reader, dir), fft_size.size, options.depths);
+			depth_data.emplace(Depth_data<P>{*depth_grid, depth_grid->template phases<P>()});
+		}
+
+		Worker<P> worker(fft_size, 1, n_bands, depth_data.has_value());
+		Matrix<float> cs_sq(n_layers, n_bands);
+		process_window(worker, reader, dir, kpoint_data, results, cs_sq, selection.band_first,
+			depth_data ? &*depth_data : nullptr, nullptr, {});
+		return cs_sq;
+	};
+
+	const auto cs_sq = compute(T{});
+	const auto cs_sq_ref = compute(F{});
+
+	double max = 0, max_deviation = 0;
+	for (std::size_t i = 0; i < cs_sq.size(); ++i)
+	{
+		max = std::max(max, static_cast<double>(cs_sq_ref.data()[i]));
+		max_deviation = std::max(max_deviation, std::abs(static_cast<double>(cs_sq.data()[i] - cs_sq_ref.data()[i])));
+	}
+
+	return max > 0 ? max_deviation / max : 0;
+}
+
+// Creates the writer of the output file of a cell direction (an index into the list of directions)
+// and of a snapshot, or of all snapshots if they are combined; if (is_resumed) is true,
+// the existing file is continued
+using Writer_factory = std::function<std::unique_ptr<Ldos_writer>(std::size_t direction, std::size_t snapshot,
+	bool is_resumed)>;
+
+// Selected bands of k-points of all snapshots are read in windows by a dedicated thread, processed by worker
+// threads along each of the cell directions (dirs) and written in the original order by the calling thread;
+// unless memory is limited, each window contains all selected bands of a k-point; (T) is the FFT precision,
+// (F) is the precision of coefficients in the file
+template<typename T, typename F = T>
+void process(Wavecar_reader& reader, const Writer_factory& make_writer, const std::vector<Cell_direction>& dirs,
+			 const Selection& selection, const Process_options& options)
+{
+	assert(!dirs.empty());
+	assert(!options.snapshot_filenames.empty());
+
+	const auto n_dirs = dirs.size();
+	std::vector<Fft_size> fft_sizes;
+	std::vector<std::size_t> n_layers;
+	for (auto dir : dirs)
+	{
+		fft_sizes.push_back(get_fft_size(reader, dir));
+		n_layers.push_back(options.depths.empty() ? fft_sizes.back().size : options.depths.size());
+	}
+
+	// With multiple processes, (snapshot, spin, k-point) items are distributed between them cyclically
+	const auto n_snapshots = options.snapshot_filenames.size();
+	const auto n_snapshot_blocks = reader.n_spins() * selection.kpoints.size();
+	const auto n_blocks = n_snapshots * n_snapshot_blocks;
+	const auto n_items = (n_blocks + n_processes() - 1 - process_rank()) / n_processes();
+	const auto is_distributed = n_processes() > 1;
+
+	const auto energy_grid = options.energy_grid ? &*options.energy_grid : nullptr;
+	const auto is_summed = energy_grid && !options.is_k_resolved;
+
+	// LDOS(E, z) of the current k-point or of each spin projection, summed over k-points,
+	// charge density profiles of each spin projection, summed over k-points, and extreme values;
+	// the matrices of each cell direction follow those of the previous one
+	Progress progress;
+	const auto n_doss = energy_grid ? (options.is_k_resolved ? 1 : reader.n_spins()) : 0;
+	for (std::size_t id = 0; id < n_dirs; ++id)
+	{
+		for (std::size_t i = 0; i < n_doss; ++i)
+			progress.doss.emplace_back(n_layers[id], energy_grid->size());
+		for (std::size_t is = 0; is < reader.n_spins(); ++is)
+			progress.profiles.emplace_back(n_layers[id], options.partial_windows.size() + 1);
+	}
+	progress.cs_sq_max.resize(n_dirs);
+	progress.dos_max.resize(n_dirs);
+
+	const auto reset_sums = [&progress]
+	{
+		for (auto& dos : progress.doss)
+			dos.fill(0);
+		for (auto& profile : progress.profiles)
+			profile.fill(0);
+	};
+
+	const auto reset_extreme_values = [&progress]
+	{
+		progress.energy_min = std::numeric_limits<double>::max();
+		progress.energy_max = -std::numeric_limits<double>::max();
+		std::fill(progress.cs_sq_max.begin(), progress.cs_sq_max.end(), -std::numeric_limits<float>::max());
+		std::fill(progress.dos_max.begin(), progress.dos_max.end(), -std::numeric_limits<float>::max());
+	};
+
+	reset_sums();
+	reset_extreme_values();
+
+	// Snapshots written into separate files are resumed from the first unfinished one
+	std::optional<Journal> journal;
+	std::optional<std::uint64_t> journal_run_hash;
+	std::vector<Ldos_writer_state> writer_states(n_dirs);
+	if (!options.journal_filename.empty())
+	{
+		journal.emplace(options.journal_filename);
+		if (options.is_resumed && journal->exists())
+			journal_run_hash = journal->read(progress, writer_states);
+	}
+
+	if (progress.n_items_done > n_items || progress.snapshot >= n_snapshots)
+		throw std::runtime_error("Journal '" + options.journal_filename + "' belongs to another run");
+
+	// Runs in mixed and full precision are not resumed from each other
+	std::vector<std::unique_ptr<Ldos_writer>> writers;
+	auto run_hash = std::uint64_t{sizeof(T) << 4 | sizeof(F)};
+	for (std::size_t id = 0; id < n_dirs; ++id)
+	{
+		writers.push_back(make_writer(id, options.is_combined ? 0 : progress.snapshot, options.is_resumed));
+		run_hash = run_hash * 31 + writers.back()->header_hash();
+	}
+
+	const auto get_writer_states = [&writers]
+	{
+		std::vector<Ldos_writer_state> states;
+		for (auto& writer : writers)
+		{
+			writer->sync();
+			states.push_back(writer->state());
+		}
+		return states;
+	};
+
+	if (journal_run_hash)
+	{
+		if (*journal_run_hash != run_hash)
+			throw std::runtime_error("Journal '" + options.journal_filename + "' belongs to another run");
 
-	std::cout << std::string(reader.n_spins() * reader.n_kpoints(), '*') << std::endl;
+		for (std::size_t id = 0; id < n_dirs; ++id)
+			writers[id]->restore(writer_states[id]);
+		std::cout << "Resumed after " << progress.n_items_done << " of " << n_items << " (spin, k-point) pairs\n" << std::endl;
+	}
+	if (journal)
+		journal->write(run_hash, progress, get_writer_states());
+	const auto n_items_left = n_items - progress.n_items_done;
+
+	// Threads are first distributed over k-points; if there are fewer k-points
+	// than threads, bands of each k-point are split between the remaining ones
+	const auto n_workers = std::clamp<std::size_t>(n_items_left, 1, options.n_threads);
+	const auto n_band_threads = std::min(options.n_threads / n_workers, selection.n_bands);
+	const auto n_fft_threads = n_workers * n_band_threads;
+
+	// Besides one slot per worker, one slot is being read and one is being written
+	const auto n_slots = n_workers + 2;
+
+	if (!options.fft_backends_to_time.empty() && options.depths.empty())
+	{
+		const auto backend = fft_select_fastest_backend<T>(options.fft_backends_to_time,
+			fft_sizes.front().size, fft_chunk_columns);
+		std::cout << "Selected FFT backend: " << fft_backend_name(backend) << '\n' << std::endl;
+	}
 
+	// Phase factors of depth samples are shared by all threads; the vectors are sized up front,
+	// since depth data refer to their grids
+	std::vector<std::optional<Depth_grid>> depth_grids(n_dirs);
+	std::vector<std::optional<Depth_data<T>>> depth_datas(n_dirs);
+	if (!options.depths.empty())
+		for (std::size_t id = 0; id < n_dirs; ++id)
+		{
+			depth_grids[id].emplace(get_height(reader, dirs[id]), fft_sizes[id].size, options.depths);
+			depth_datas[id].emplace(Depth_data<T>{*depth_grids[id], depth_grids[id]->phases<T>()});
+		}
+
+	// The FFT box has the same size along any direction
+	const auto band_box_memory = fft_sizes.front().size * fft_sizes.front().n_transforms * sizeof(std::complex<T>);
+
+	// If memory is limited, a quarter of it at most goes to FFT buffers of all directions
+	const auto fft_memory = options.max_memory ?
+		std::min(fft_batch_memory, options.max_memory / 4 / n_fft_threads / n_dirs) : fft_batch_memory;
+	const auto max_batch_size = (selection.n_bands + n_band_threads - 1) / n_band_threads;
+	const auto batch_size = std::clamp<std::size_t>(fft_memory / band_box_memory, 1, max_batch_size);
+
+	// The rest of memory goes to coefficients of band windows
+	auto window_memory = std::numeric_limits<std::size_t>::max();
+	if (options.max_memory)
+	{
+		std::size_t used_memory = 0;
+		for (std::size_t id = 0; id < n_dirs; ++id)
+		{
+			const auto thread_memory = depth_datas[id] ?
+				depth_datas[id]->phases.rows() * fft_sizes[id].n_transforms * sizeof(std::complex<T>) :
+				batch_size * band_box_memory;
+			const auto dos_size = energy_grid ? n_layers[id] * energy_grid->size() : 0;
+			used_memory += n_fft_threads * thread_memory +
+				n_slots * n_layers[id] * selection.n_bands * sizeof(float) +
+				(n_slots + reader.n_spins()) * dos_size * sizeof(float);
+		}
+		if (used_memory >= options.max_memory)
+			throw std::runtime_error("Memory limit is too low");
+
+		window_memory = (options.max_memory - used_memory) / n_slots;
+	}
+
+	// Snapshots have the same geometry, so window sizes are found from the first one
+	std::vector<std::size_t> window_sizes;
 	for (std::size_t is = 0; is < reader.n_spins(); ++is)
-		for (std::size_t ik = 0; ik < reader.n_kpoints(); ++ik)
+		for (auto ik : selection.kpoints)
 		{
-			reader.get_kpoint_data(is, ik, kpoint_data);
+			const auto band_memory = reader.n_plane_waves(is, ik) * sizeof(std::complex<F>);
+			if (band_memory > window_memory)
+				throw std::runtime_error("Memory limit is too low");
 
-			cs_sq.fill(0);
-			for (std::size_t ib = 0; ib < reader.n_bands(); ++ib)
-			{
-				energy_min = std::min(energy_min, kpoint_data.energies[ib]);
-				energy_max = std::max(energy_max, kpoint_data.energies[ib]);
+			window_sizes.push_back(std::min(window_memory / band_memory, selection.n_bands));
+		}
 
-				map_g_sphere_to_fft_blocks(reader, cs, kpoint_data, ib, dir);
-				fft.transform();
+	// Coefficient records of bands and k-points that are not selected are never read
+	std::vector<Band_window> windows;
+	const auto band_last = selection.band_first + selection.n_bands;
+	for (std::size_t block = 0; block < n_blocks; ++block)
+	{
+		if (block % n_processes() != process_rank() || block / n_processes() < progress.n_items_done)
+			continue;
+
+		const auto snapshot_block = block % n_snapshot_blocks;
+		const auto is = snapshot_block / selection.kpoints.size();
+		const auto ik = selection.kpoints[snapshot_block % selection.kpoints.size()];
+		const auto window_size = window_sizes[snapshot_block];
+		for (auto ib = selection.band_first; ib < band_last; ib += window_size)
+			windows.push_back({block / n_snapshot_blocks, block, block / n_processes(), is, ik, ib,
+				std::min(window_size, band_last - ib)});
+	}
+
+	// Each worker has its own FFT layout and buffers for each direction
+	std::vector<std::unique_ptr<Worker<T>>> workers;
+	for (std::size_t i = 0; i < n_workers; ++i)
+		for (std::size_t id = 0; id < n_dirs; ++id)
+			workers.push_back(std::make_unique<Worker<T>>(fft_sizes[id], n_band_threads, batch_size,
+				depth_datas[id].has_value()));
+
+	// Windows in flight belong to no more than (n_slots) consecutive items,
+	// so the item (i) can use the LDOS matrices (i % n_slots)
+	std::vector<Window_slot<F>> slots(n_slots);
+	std::vector<Matrix<float>> cs_sqs;
+	for (std::size_t i = 0; i < n_slots; ++i)
+		for (std::size_t id = 0; id < n_dirs; ++id)
+			cs_sqs.emplace_back(n_layers[id], selection.n_bands);
+
+	for (auto& slot : slots)
+	{
+		slot.results.resize(n_dirs);
+		for (std::size_t id = 0; id < n_dirs; ++id)
+		{
+			if (energy_grid)
+				slot.results[id].dos.resize(n_layers[id], energy_grid->size());
+			slot.results[id].profiles.resize(n_layers[id], options.partial_windows.size() + 1);
+		}
+	}
+
+	auto& doss = progress.doss;
+	auto& profiles = progress.profiles;
+	const auto k_weight = 1.f / static_cast<float>(selection.kpoints.size());
+	const auto dos_weight = options.is_k_resolved ? 1.f : k_weight;
+
+	const auto get_cs_sq = [&](const Band_window& window, std::size_t id) -> Matrix<float>&
+	{
+		return cs_sqs[window.item % n_slots * n_dirs + id];
+	};
 
-				// Sum over G||
-				for (std::size_t ip = 0; ip < fft_size.n_transforms; ++ip)
-					for (std::size_t il = 0; il < fft_size.size; ++il)
+	auto& energy_min = progress.energy_min;
+	auto& energy_max = progress.energy_max;
+	auto& cs_sq_max = progress.cs_sq_max;
+	auto& dos_max = progress.dos_max;
+
+	const auto update_dos_max = [&dos_max](std::size_t id, const Matrix<float>& dos)
+	{
+		dos_max[id] = std::max(dos_max[id], *std::max_element(dos.data(), dos.data() + dos.size()));
+	};
+
+	// Snapshots other than the first one are opened by the reading thread one at a time,
+	// they share G-spheres with the first one
+	std::optional<Wavecar_reader> snapshot_reader;
+	std::size_t snapshot_reader_index = 0;
+	const auto get_reader = [&](std::size_t snapshot) -> Wavecar_reader&
+	{
+		if (snapshot == 0)
+			return reader;
+
+		if (snapshot != snapshot_reader_index)
+		{
+			snapshot_reader.emplace(options.snapshot_filenames[snapshot], reader.g_sphere_cache());
+			if (reader.is_memory_mapped())
+				snapshot_reader->enable_memory_map();
+			snapshot_reader_index = snapshot;
+		}
+
+		return *snapshot_reader;
+	};
+
+	// Sums over the current snapshot are collected by the root process, which writes the rest of it;
+	// extreme values are collected at the end of each file
+	const auto finish_snapshot = [&]
+	{
+		if (is_summed)
+			for (auto& dos : doss)
+				reduce_sum(dos.data(), dos.size());
+		for (auto& profile : profiles)
+			reduce_sum(profile.data(), profile.size());
+
+		if (is_root_process())
+			for (std::size_t id = 0; id < n_dirs; ++id)
+			{
+				auto& writer = *writers[id];
+				if (is_distributed && !is_summed)
+					writer.seek_profiles(options.is_combined ? progress.snapshot : 0);
+
+				if (is_summed)
+					for (std::size_t i = 0; i < n_doss; ++i)
 					{
-						const auto sq = static_cast<float>(std::norm(cs(il, ip)));
-						cs_sq_max = std::max(cs_sq_max, sq);
-						cs_sq(il, ib) += sq;
+						const auto& dos = doss[id * n_doss + i];
+						writer.write_dos(dos);
+						update_dos_max(id, dos);
 					}
+
+				for (std::size_t is = 0; is < reader.n_spins(); ++is)
+					writer.write_profiles(profiles[id * reader.n_spins() + is]);
 			}
 
-			writer.write_ldos(kpoint_data.k, kpoint_data.energies, kpoint_data.occupations, cs_sq);
-			std::cout << '.' << std::flush;
+		if (!options.is_combined || progress.snapshot + 1 == n_snapshots)
+		{
+			const auto file_energy_min = reduce_min(energy_min);
+			const auto file_energy_max = reduce_max(energy_max);
+			for (std::size_t id = 0; id < n_dirs; ++id)
+			{
+				const auto file_cs_sq_max = reduce_max(cs_sq_max[id]);
+				const auto file_dos_max = reduce_max(dos_max[id]);
+
+				// With LDOS(E, z) output, the maximum value refers to it
+				if (is_root_process())
+				{
+					writers[id]->write_minmax_values(file_energy_min, file_energy_max,
+						energy_grid ? file_dos_max : file_cs_sq_max);
+					writers[id]->write_index();
+				}
+			}
+			reset_extreme_values();
 		}
 
-	writer.write_minmax_values(energy_min, energy_max, cs_sq_max);
+		reset_sums();
+		++progress.snapshot;
+		if (progress.snapshot == n_snapshots)
+			return;
+
+		if (!options.is_combined)
+			for (std::size_t id = 0; id < n_dirs; ++id)
+			{
+				writers[id].reset();
+				writers[id] = make_writer(id, progress.snapshot, false);
+			}
+
+		if (journal)
+			journal->write(run_hash, progress, get_writer_states());
+	};
+
+	std::cout << std::string(n_items_left, '*') << std::endl;
+
+	run_pipeline(windows.size(), n_workers, slots.size(),
+		[&](std::size_t i, std::size_t slot)
+		{
+			auto& snapshot_reader = get_reader(windows[i].snapshot);
+			auto& kpoint_data = slots[slot].kpoint_data;
+			snapshot_reader.get_kpoint_header(windows[i].spin, windows[i].kpoint, kpoint_data);
+			snapshot_reader.get_kpoint_bands(windows[i].band_first, windows[i].n_bands, kpoint_data);
+		},
+		[&](std::size_t worker, std::size_t i, std::size_t slot)
+		{
+			for (std::size_t id = 0; id < n_dirs; ++id)
+				process_window(*workers[worker * n_dirs + id], reader, dirs[id], slots[slot].kpoint_data,
+					slots[slot].results[id], get_cs_sq(windows[i], id), selection.band_first,
+					depth_datas[id] ? &*depth_datas[id] : nullptr, energy_grid, options.partial_windows);
+		},
+		[&](std::size_t i, std::size_t slot)
+		{
+			const auto& window = windows[i];
+			while (progress.snapshot < window.snapshot)
+				finish_snapshot();
+
+			for (std::size_t id = 0; id < n_dirs; ++id)
+			{
+				const auto& results = slots[slot].results[id];
+				cs_sq_max[id] = std::max(cs_sq_max[id], results.cs_sq_max);
+
+				auto& profile = profiles[id * reader.n_spins() + window.spin];
+				for (std::size_t j = 0; j < profile.size(); ++j)
+					profile.data()[j] += k_weight * results.profiles.data()[j];
+
+				if (energy_grid)
+				{
+					auto& dos = doss[id * n_doss + (options.is_k_resolved ? 0 : window.spin)];
+					if (options.is_k_resolved && window.band_first == selection.band_first)
+						dos.fill(0);
+
+					for (std::size_t j = 0; j < dos.size(); ++j)
+						dos.data()[j] += dos_weight * results.dos.data()[j];
+				}
+			}
+
+			if (window.band_first + window.n_bands < band_last)
+				return;
+
+			const auto& kpoint_data = slots[slot].kpoint_data;
+			const auto energies = kpoint_data.energies.begin() + static_cast<std::ptrdiff_t>(selection.band_first);
+			const auto [e_min, e_max] = std::minmax_element(energies, energies + static_cast<std::ptrdiff_t>(selection.n_bands));
+			energy_min = std::min(energy_min, *e_min);
+			energy_max = std::max(energy_max, *e_max);
+
+			for (std::size_t id = 0; id < n_dirs; ++id)
+			{
+				auto& writer = *writers[id];
+
+				// Blocks of each snapshot are numbered from zero in separate files
+				if (is_distributed && !is_summed)
+					writer.seek_block(options.is_combined ? window.block : window.block % n_snapshot_blocks);
+
+				if (!energy_grid)
+					writer.write_ldos(kpoint_data.k, kpoint_data.energies, kpoint_data.occupations, get_cs_sq(window, id));
+				else if (options.is_k_resolved)
+				{
+					writer.write_dos(kpoint_data.k, doss[id * n_doss]);
+					update_dos_max(id, doss[id * n_doss]);
+				}
+			}
+
+			++progress.n_items_done;
+			if (journal)
+				journal->write(run_hash, progress, get_writer_states());
+
+			std::cout << '.' << std::flush;
+		});
+
+	while (progress.snapshot < n_snapshots)
+		finish_snapshot();
+
+	if (journal)
+		journal->remove();
 	std::cout << std::endl;
 }
 
+// Parses "<min>:<max>" string
+std::pair<double, double> parse_range(const std::string& str)
+{
+	const auto pos = str.find(':');
+	if (pos == std::string::npos)
+		throw std::runtime_error("Bad range '" + str + "'");
+
+	const auto min = std::stod(str.substr(0, pos));
+	const auto max = std::stod(str.substr(pos + 1));
+	if (min > max)
+		throw std::runtime_error("Bad range '" + str + "'");
+
+	return {min, max};
+}
+
+// Parses "1,3,5-8"-like string of one-based indices
+// and returns sorted unique zero-based indices
+std::vector<std::size_t> parse_index_list(const std::string& str, std::size_t size)
+{
+	std::vector<std::size_t> indices;
+
+	std::istringstream ss(str);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		const auto pos = item.find('-');
+		const auto first = std::stoul(item.substr(0, pos));
+		const auto last = (pos == std::string::npos) ? first : std::stoul(item.substr(pos + 1));
+		if (first == 0 || first > last || last > size)
+			throw std::runtime_error("Bad index list '" + str + "'");
+
+		for (auto i = first; i <= last; ++i)
+			indices.push_back(i - 1);
+	}
+
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	if (indices.empty())
+		throw std::runtime_error("Bad index list '" + str + "'");
+
+	return indices;
+}
+
+// Selects k-points and bands; if an energy window is given, the bands are narrowed
+// to those that fall into the window for at least one selected k-point of any snapshot,
+// only k-point header records being read for that; (reader) is that of the first snapshot
+Selection get_selection(Wavecar_reader& reader, const std::vector<std::string>& snapshot_filenames,
+						const Command_line& cl, double fermi_energy)
+{
+	Selection selection;
+
+	if (cl.option_exists("--kpoints"))
+		selection.kpoints = parse_index_list(cl.get_option("--kpoints"), reader.n_kpoints());
+	else
+		for (std::size_t ik = 0; ik < reader.n_kpoints(); ++ik)
+			selection.kpoints.push_back(ik);
+
+	auto band_first = std::size_t{0};
+	auto band_last = reader.n_bands();
+	if (cl.option_exists("--bands"))
+	{
+		const auto [first, last] = parse_range(cl.get_option("--bands"));
+		if (first < 1 || last > reader.n_bands() || first != std::floor(first) || last != std::floor(last))
+			throw std::runtime_error("Bad band range");
+
+		band_first = static_cast<std::size_t>(first) - 1;
+		band_last = static_cast<std::size_t>(last);
+	}
+
+	if (cl.option_exists("--energies"))
+	{
+		const auto [min, max] = parse_range(cl.get_option("--energies"));
+
+		auto window_first = band_last;
+		auto window_last = band_first;
+		std::vector<double> energies;
+		const auto add_snapshot = [&](Wavecar_reader& snapshot_reader)
+		{
+			for (std::size_t is = 0; is < snapshot_reader.n_spins(); ++is)
+				for (auto ik : selection.kpoints)
+				{
+					snapshot_reader.get_kpoint_energies(is, ik, energies);
+					for (auto ib = band_first; ib < band_last; ++ib)
+					{
+						const auto energy = energies[ib] - fermi_energy;
+						if (energy >= min && energy <= max)
+						{
+							window_first = std::min(window_first, ib);
+							window_last = std::max(window_last, ib + 1);
+						}
+					}
+				}
+		};
+
+		// All snapshots share the same bands, so the window covers the bands of each of them
+		add_snapshot(reader);
+		for (std::size_t i = 1; i < snapshot_filenames.size(); ++i)
+		{
+			Wavecar_reader snapshot_reader(snapshot_filenames[i], reader.g_sphere_cache());
+			add_snapshot(snapshot_reader);
+		}
+
+		if (window_first >= window_last)
+			throw std::runtime_error("No bands in the energy window");
+
+		band_first = window_first;
+		band_last = window_last;
+	}
+
+	selection.band_first = band_first;
+	selection.n_bands = band_last - band_first;
+	return selection;
+}
+
+// Parses "--dos <min>:<max>:<n>" and "--broadening <gauss|lorentz>:<width>" options,
+// energies being given relative to the Fermi level
+std::optional<Energy_grid> get_energy_grid(const Command_line& cl, double fermi_energy)
+{
+	if (!cl.option_exists("--dos"))
+		return {};
+
+	const auto& grid = cl.get_option("--dos");
+	const auto pos = grid.rfind(':');
+	if (pos == std::string::npos)
+		throw std::runtime_error("Bad energy grid '" + grid + "'");
+
+	const auto [min, max] = parse_range(grid.substr(0, pos));
+	const auto size = std::stoi(grid.substr(pos + 1));
+	if (min == max || size < 2)
+		throw std::runtime_error("Bad energy grid '" + grid + "'");
+
+	const auto broadening = cl.get_option_or("--broadening", "gauss:0.05");
+	const auto type = broadening.substr(0, broadening.find(':'));
+	const auto width = std::stod(broadening.substr(std::min(type.length() + 1, broadening.length())));
+
+	if ((type != "gauss" && type != "lorentz") || width <= 0)
+		throw std::runtime_error("Bad broadening '" + broadening + "'");
+
+	return Energy_grid(fermi_energy + min, fermi_energy + max, static_cast<std::size_t>(size),
+		type == "gauss" ? Energy_grid::Broadening::GAUSSIAN : Energy_grid::Broadening::LORENTZIAN, width);
+}
+
+Process_options get_process_options(const Command_line& cl, double fermi_energy)
+{
+	Process_options options;
+
+	const auto n_threads = std::stoi(cl.get_option_or("-j", "1"));
+	if (n_threads <= 0)
+		throw std::runtime_error("Bad number of threads");
+	options.n_threads = static_cast<std::size_t>(n_threads);
+
+	const auto max_memory = std::stod(cl.get_option_or("--max-memory", "0"));
+	if (max_memory < 0)
+		throw std::runtime_error("Bad memory limit");
+	options.max_memory = static_cast<std::size_t>(max_memory * (1 << 20));
+
+	options.energy_grid = get_energy_grid(cl, fermi_energy);
+	options.is_k_resolved = cl.option_exists("--k-resolved");
+
+	if (cl.option_exists("--partial"))
+	{
+		std::istringstream ss(cl.get_option("--partial"));
+		std::string window;
+		while (std::getline(ss, window, ','))
+		{
+			const auto [min, max] = parse_range(window);
+			options.partial_windows.emplace_back(fermi_energy + min, fermi_energy + max);
+		}
+	}
+
+	if (cl.option_exists("--depths"))
+	{
+		std::istringstream ss(cl.get_option("--depths"));
+		std::string depth;
+		while (std::getline(ss, depth, ','))
+			if (depth.find(':') == std::string::npos)
+				options.depths.emplace_back(std::stod(depth), std::stod(depth));
+			else
+				options.depths.push_back(parse_range(depth));
+
+		if (options.depths.empty())
+			throw std::runtime_error("Bad depths");
+	}
+
+	if (cl.option_exists("--chunks"))
+	{
+		const auto chunks = cl.get_option("--chunks");
+		const auto pos = chunks.find(':');
+		if (pos == std::string::npos)
+			throw std::runtime_error("Bad chunks '" + chunks + "'");
+
+		options.format.layer_chunk = std::stoul(chunks.substr(0, pos));
+		options.format.column_chunk = std::stoul(chunks.substr(pos + 1));
+	}
+
+	const auto encoding = cl.get_option_or("--encoding", "float");
+	if (encoding == "float")
+		options.format.encoding = Ldos_encoding::FLOAT;
+	else if (encoding == "u16")
+		options.format.encoding = Ldos_encoding::UINT16;
+	else if (encoding == "u8")
+		options.format.encoding = Ldos_encoding::UINT8;
+	else
+		throw std::runtime_error("Bad encoding '" + encoding + "'");
+
+	options.format.threshold = std::stof(cl.get_option_or("--threshold", "0"));
+	if (options.format.threshold < 0 || options.format.threshold >= 1)
+		throw std::runtime_error("Bad threshold");
+	if (options.format.threshold > 0 && options.format.encoding == Ldos_encoding::FLOAT)
+		throw std::runtime_error("Threshold requires quantized encoding");
+	options.format.n_threads = options.n_threads;
+
+	return options;
+}
+
+Fft_effort get_fft_effort(const Command_line& cl)
+{
+	const auto effort = cl.get_option_or("--fft-effort", "estimate");
+	if (effort == "estimate")
+		return Fft_effort::ESTIMATE;
+	else if (effort == "measure")
+		return Fft_effort::MEASURE;
+	else if (effort == "patient")
+		return Fft_effort::PATIENT;
+	else if (effort == "exhaustive")
+		return Fft_effort::EXHAUSTIVE;
+	else
+		throw std::runtime_error("Bad FFT planner effort '" + effort + "'");
+}
+
+// Sets FFT backend, its planner effort and the number of its threads, returns
+// the backends to select the fastest one from by timing, or none if the backend is given
+std::vector<Fft_backend> set_fft_options(const Command_line& cl)
+{
+	fft_set_effort(get_fft_effort(cl));
+
+	const auto n_threads = std::stoi(cl.get_option_or("--fft-threads", "1"));
+	if (n_threads <= 0)
+		throw std::runtime_error("Bad number of FFT threads");
+
+	const auto backend = cl.get_option_or("--fft-backend", fft_backend() == Fft_backend::FFTW ? "fftw" : "mkl");
+	if (backend == "fftw" || backend == "mkl")
+	{
+		fft_set_backend(backend == "fftw" ? Fft_backend::FFTW : Fft_backend::MKL);
+		fft_set_n_threads(fft_backend(), static_cast<std::size_t>(n_threads));
+		return {};
+	}
+	if (backend != "auto")
+		throw std::runtime_error("Bad FFT backend '" + backend + "'");
+
+	// Only backends that can use the given number of threads take part
+	std::vector<Fft_backend> backends;
+	for (auto b : {Fft_backend::FFTW, Fft_backend::MKL})
+		if (fft_has_backend(b) && (n_threads == 1 || fft_has_threads(b)))
+		{
+			fft_set_n_threads(b, static_cast<std::size_t>(n_threads));
+			backends.push_back(b);
+		}
+
+	if (backends.empty())
+		throw std::runtime_error("No FFT backend supports threads");
+
+	fft_set_backend(backends.front());
+	return backends;
+}
+
+// Parses "a0,a2"-like list of cell directions LDOS is resolved along,
+// by default the direction of the longest lattice vector is taken
+std::vector<Cell_direction> get_directions(const Wavecar_reader& reader, const Command_line& cl)
+{
+	if (!cl.option_exists("--directions"))
+		return {get_direction(reader)};
+
+	const auto& list = cl.get_option("--directions");
+	std::vector<Cell_direction> dirs;
+
+	std::istringstream ss(list);
+	std::string name;
+	while (std::getline(ss, name, ','))
+	{
+		Cell_direction dir;
+		if (name == "a0")
+			dir = Cell_direction::A0;
+		else if (name == "a1")
+			dir = Cell_direction::A1;
+		else if (name == "a2")
+			dir = Cell_direction::A2;
+		else
+			throw std::runtime_error("Bad cell directions '" + list + "'");
+
+		if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end())
+			throw std::runtime_error("Bad cell directions '" + list + "'");
+		dirs.push_back(dir);
+	}
+
+	if (dirs.empty())
+		throw std::runtime_error("Bad cell directions '" + list + "'");
+
+	return dirs;
+}
+
+// Returns WAVECAR filenames of snapshots: those listed in the --batch file, one per line,
+// or those matching the -w pattern in sorted order
+std::vector<std::string> get_snapshot_filenames(const Command_line& cl)
+{
+	std::vector<std::string> filenames;
+	if (cl.option_exists("--batch"))
+	{
+		const auto& list_filename = cl.get_option("--batch");
+		std::ifstream file(list_filename);
+		if (!file)
+			throw std::runtime_error("File '" + list_filename + "' cannot be opened");
+
+		std::string line;
+		while (std::getline(file, line))
+			if (!line.empty())
+				filenames.push_back(line);
+	}
+	else
+	{
+		// If nothing matches, the pattern is taken as a filename
+		glob_t matches;
+		if (glob(cl.get_option_or("-w", "WAVECAR").c_str(), GLOB_NOCHECK, nullptr, &matches) == 0)
+			filenames.assign(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+		globfree(&matches);
+	}
+
+	if (filenames.empty())
+		throw std::runtime_error("No WAVECAR files given");
+
+	return filenames;
+}
+
+// Checks that the snapshot can be processed together with the first one; output blocks
+// are labelled by k-point indices, so k-vectors should match too
+void check_snapshot(Wavecar_reader& first, Wavecar_reader& snapshot)
+{
+	const auto error = "Snapshot '" + snapshot.filename() + "' does not match '" + first.filename() + "'";
+	if (snapshot.a() != first.a() || snapshot.e_cut() != first.e_cut() ||
+		snapshot.n_spins() != first.n_spins() || snapshot.n_kpoints() != first.n_kpoints() ||
+		snapshot.n_bands() != first.n_bands() || snapshot.is_single_precision() != first.is_single_precision() ||
+		snapshot.is_gamma_only() != first.is_gamma_only())
+		throw std::runtime_error(error);
+
+	for (std::size_t ik = 0; ik < first.n_kpoints(); ++ik)
+		if (snapshot.get_kpoint(ik) != first.get_kpoint(ik))
+			throw std::runtime_error(error + ": k-point " + std::to_string(ik + 1) + " differs");
+}
+
+// Returns the output filename of a snapshot written into its own file, "{}" in the (pattern)
+// is replaced by the one-based snapshot index padded with zeros
+std::string snapshot_output_filename(const std::string& pattern, std::size_t snapshot, std::size_t n_snapshots)
+{
+	const auto index = std::to_string(snapshot + 1);
+	const auto width = std::to_string(n_snapshots).length();
+
+	auto filename = pattern;
+	return filename.replace(filename.find("{}"), 2, std::string(width - index.length(), '0') + index);
+}
+
 void print_wavecar_info(const Wavecar_reader& reader)
 {
 	std::cout << "WAVECAR file:\n"
 			  << "Precision: " << (reader.is_single_precision() ? "single" : "double") << '\n'
+			  << "Gamma-only: " << (reader.is_gamma_only() ? "yes" : "no") << '\n'
 			  << "Number of spin components: " << reader.n_spins() << '\n'
 			  << "Number of k-points: " << reader.n_kpoints() << '\n'
 			  << "Number of bands: " << reader.n_bands() << '\n'
@@ -184,10 +1425,65 @@ void print_help()
 			  << "    vasp_ldos [options]\n"
 			  << "Options:\n"
 			  << "    -h               print help\n"
-			  << "    -o <name>        output LDOS filename (no default)\n"
-			  << "    -w <name>        input WAVECAR filename (default: \"WAVECAR\")\n"
+			  << "    -o <name>        output LDOS filename, with several WAVECAR files \"{}\"\n"
+			  << "                     in it is replaced by the snapshot number to write\n"
+			  << "                     each snapshot into its own file (no default)\n"
+			  << "    -w <pattern>     input WAVECAR filename or wildcard pattern, several\n"
+			  << "                     files are snapshots of the same geometry (default: \"WAVECAR\")\n"
+			  << "    --batch <name>   file listing input WAVECAR filenames, one per line\n"
 			  << "    -f <value>       Fermi level value (default: 0)\n"
-			  << "    -c <comment>     arbitrary text comment (default: none)\n\n"
+			  << "    -c <comment>     arbitrary text comment (default: none)\n"
+			  << "    -j <number>      number of worker threads (default: 1)\n"
+			  << "    -m               memory-map WAVECAR file instead of reading it\n"
+			  << "    --resume         keep a journal of progress and continue an interrupted\n"
+			  << "                     run from it if it exists\n"
+			  << "    --max-memory <MB>\n"
+			  << "                     approximate memory limit, bands are read in windows\n"
+			  << "                     to fit into it (default: no limit)\n"
+			  << "    --kpoints <list> one-based k-point indices, e.g. \"1,3,5-8\" (default: all)\n"
+			  << "    --bands <first>:<last>\n"
+			  << "                     one-based band range (default: all)\n"
+			  << "    --energies <min>:<max>\n"
+			  << "                     energy window relative to the Fermi level, only bands\n"
+			  << "                     that fall into it are processed (default: all)\n"
+			  << "    --dos <min>:<max>:<n>\n"
+			  << "                     write LDOS(E, z) on the energy grid of (n) points\n"
+			  << "                     relative to the Fermi level instead of band-resolved LDOS\n"
+			  << "    --broadening <gauss|lorentz>:<width>\n"
+			  << "                     broadening of LDOS(E, z) (default: gauss:0.05)\n"
+			  << "    --k-resolved     write LDOS(E, z) for each k-point instead of\n"
+			  << "                     summing it over k-points\n"
+			  << "    --partial <min>:<max>[,<min>:<max>...]\n"
+			  << "                     energy windows relative to the Fermi level of partial\n"
+			  << "                     charge density profiles (default: none)\n"
+			  << "    --directions <list>\n"
+			  << "                     cell directions to resolve LDOS along, e.g. \"a0,a2\",\n"
+			  << "                     each written into its own file with the direction name\n"
+			  << "                     appended (default: the longest lattice vector)\n"
+			  << "    --depths <z>|<min>:<max>[,...]\n"
+			  << "                     evaluate LDOS only at these depths or averaged over\n"
+			  << "                     these slabs, in Angstroms (default: all FFT grid points)\n"
+			  << "    --chunks <layers>:<columns>\n"
+			  << "                     write LDOS by chunks of this number of layers and bands\n"
+			  << "                     (or energy grid points), 0 for all (default: 0:0)\n"
+			  << "    --encoding <float|u16|u8>\n"
+			  << "                     LDOS encoding, quantized ones are relative to the maximum\n"
+			  << "                     of each chunk and compress zeros (default: float)\n"
+			  << "    --threshold <value>\n"
+			  << "                     with quantized encodings, store LDOS values less than\n"
+			  << "                     this fraction of the block maximum as zeros (default: 0)\n"
+			  << "    --fft-effort <estimate|measure|patient|exhaustive>\n"
+			  << "                     FFTW planner effort (default: estimate)\n"
+			  << "    --fft-wisdom <name>\n"
+			  << "                     FFTW wisdom file to import tuned plans from\n"
+			  << "                     and export them to (default: none)\n"
+			  << "    --fft-backend <fftw|mkl|auto>\n"
+			  << "                     FFT library, \"auto\" selects the fastest one by timing\n"
+			  << "                     (default: FFTW if available)\n"
+			  << "    --fft-threads <number>\n"
+			  << "                     number of threads used by each FFT (default: 1)\n"
+			  << "    --mixed-precision\n"
+			  << "                     process double precision WAVECAR files in single precision\n\n"
 			  << "If no output filename is given, WAVECAR file basic\n"
 			  << "information is displayed and the program terminates." << std::endl;
 }
@@ -196,6 +1492,14 @@ void print_help()
 
 int main(int argc, char* argv[])
 {
+#ifdef HAVE_MPI
+	const Mpi_session mpi_session(argc, argv);
+#endif
+
+	// Only the root process reports progress
+	if (!is_root_process())
+		std::cout.setstate(std::ios::failbit);
+
 	try
 	{
 		const Command_line cl(argc, argv);
@@ -206,34 +1510,111 @@ int main(int argc, char* argv[])
 			return 0;
 		}
 
-		const std::string wc_filename = cl.get_option_or("-w", "WAVECAR");
-		Wavecar_reader reader(wc_filename);
+		// Snapshots share G-spheres of the first one
+		const auto snapshot_filenames = get_snapshot_filenames(cl);
+		Wavecar_reader reader(snapshot_filenames.front());
 		print_wavecar_info(reader);
 
+		if (snapshot_filenames.size() > 1)
+		{
+			for (std::size_t i = 1; i < snapshot_filenames.size(); ++i)
+			{
+				Wavecar_reader snapshot_reader(snapshot_filenames[i], reader.g_sphere_cache());
+				check_snapshot(reader, snapshot_reader);
+			}
+			std::cout << "Snapshots: " << snapshot_filenames.size() << " WAVECAR files\n" << std::endl;
+		}
+
+		if (cl.option_exists("-m"))
+			reader.enable_memory_map();
+
 		if (!cl.option_exists("-o"))
 			return 0;
 
 		const std::string output_filename = cl.get_option("-o");
 		const auto user_comment = cl.get_option_or("-c", "");
 		const double fermi_energy = std::stod(cl.get_option_or("-f", "0"));
+		auto options = get_process_options(cl, fermi_energy);
+		options.fft_backends_to_time = set_fft_options(cl);
+		if (n_processes() > 1 && options.format.encoding != Ldos_encoding::FLOAT)
+			throw std::runtime_error("Quantized encodings are not supported with multiple processes");
 
-		const auto cell_direction = get_direction(reader);
-		Ldos_writer writer(output_filename, reader, get_fft_size(reader, cell_direction).size,
-			get_height(reader, cell_direction), fermi_energy, user_comment);
+		// Each snapshot is written into its own file if the output filename has "{}" in it
+		options.snapshot_filenames = snapshot_filenames;
+		options.is_combined = output_filename.find("{}") == std::string::npos;
+
+		// A run is resumed if the root process has left its journal, each process has its own one
+		if (cl.option_exists("--resume"))
+		{
+			if (n_processes() > 1 && snapshot_filenames.size() > 1)
+				throw std::runtime_error("Batches cannot be resumed with multiple processes");
+
+			options.journal_filename = output_filename + ".journal";
+			options.is_resumed = std::ifstream(options.journal_filename).good();
+			if (!is_root_process())
+				options.journal_filename += '.' + std::to_string(process_rank());
+		}
+		const auto wisdom_filename = cl.get_option_or("--fft-wisdom", "");
+		if (!wisdom_filename.empty() && !fft_import_wisdom(wisdom_filename))
+			std::cout << "No FFT wisdom imported from '" << wisdom_filename << "'\n";
+
+		const auto selection = get_selection(reader, snapshot_filenames, cl, fermi_energy);
+		std::cout << "Selected: " << selection.kpoints.size() << " k-points, bands "
+				  << selection.band_first + 1 << " to " << selection.band_first + selection.n_bands << '\n' << std::endl;
+
+		// All directions are computed from one read of each band
+		const auto cell_directions = get_directions(reader, cl);
+		for (auto dir : cell_directions)
+			for (const auto& [min, max] : options.depths)
+				if (min < 0 || max > get_height(reader, dir))
+					throw std::runtime_error("Depth is outside the supercell");
+
+		// With several directions, the direction name is appended to the output filename
+		const Writer_factory make_writer = [&](std::size_t direction, std::size_t snapshot, bool is_resumed)
+		{
+			const auto dir = cell_directions[direction];
+			const auto n_snapshots = snapshot_filenames.size();
+			const auto n_layers = options.depths.empty() ? get_fft_size(reader, dir).size : options.depths.size();
+			const auto dir_index = static_cast<std::size_t>(dir);
+
+			auto filename = options.is_combined ? output_filename :
+				snapshot_output_filename(output_filename, snapshot, n_snapshots);
+			if (cell_directions.size() > 1)
+				filename += ".a" + std::to_string(dir_index);
+
+			return std::make_unique<Ldos_writer>(filename, reader, selection, dir_index, n_layers, get_height(reader, dir),
+				fermi_energy, user_comment, options.energy_grid ? &*options.energy_grid : nullptr, options.is_k_resolved,
+				options.partial_windows, options.depths, options.format, options.is_combined ? n_snapshots : 1, is_resumed);
+		};
 
 		if (reader.is_single_precision())
-			process<float>(reader, writer, cell_direction);
+			process<float>(reader, make_writer, cell_directions, selection, options);
+		else if (cl.option_exists("--mixed-precision"))
+		{
+			std::cout << "Mixed precision: maximum relative deviation on sample bands is "
+					  << std::scientific << std::setprecision(2)
+					  << sample_precision_deviation<float, double>(reader, cell_directions.front(), selection, options)
+					  << std::defaultfloat << '\n' << std::endl;
+			process<float, double>(reader, make_writer, cell_directions, selection, options);
+		}
 		else
-			process<double>(reader, writer, cell_direction);
+			process<double>(reader, make_writer, cell_directions, selection, options);
+
+		// Wisdom is forgotten on cleanup
+		if (!wisdom_filename.empty() && is_root_process())
+			fft_export_wisdom(wisdom_filename);
+		fft_cleanup();
 	}
 	catch (const std::exception& e)
 	{
 		std::cerr << "Exception!\n" << e.what() << std::endl;
+		abort_processes();
 		return -1;
 	}
 	catch (...)
 	{
 		std::cerr << "Exception!" << std::endl;
+		abort_processes();
 		return -1;
 	}
 
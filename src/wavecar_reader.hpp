@@ -1,12 +1,16 @@
 #pragma once
+#include "g_sphere_cache.hpp"
+#include "mapped_file.hpp"
 #include "matrix.hpp"
 #include "vec3.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <complex>
 #include <cstddef>
 #include <fstream>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
@@ -15,24 +19,67 @@
 template<typename T>
 struct Kpoint_data
 {
+	std::size_t spin;
+	std::size_t kpoint;
+
 	Vec3<double> k;
 	std::size_t n_plane_waves;
 	std::vector<double> energies;
 	std::vector<double> occupations;
-	Matrix<std::complex<T>> coeffs;
-	std::vector<Vec3<std::size_t>> gs;
+	std::shared_ptr<const G_sphere> gs;
+
+	// Coefficients (n_plane_waves x coeffs.cols()) of bands starting from (band_first),
+	// point either into (coeffs_buffer) or directly into the memory-mapped file,
+	// which is then kept mapped by (mapped_file) even if the reader is closed
+	std::size_t band_first;
+	Matrix_view<const std::complex<T>> coeffs;
+	Matrix<std::complex<T>> coeffs_buffer;
+	std::shared_ptr<const Mapped_file> mapped_file;
 };
 
 class Wavecar_reader
 {
 public:
-	Wavecar_reader(const std::string& filename)
+	// Readers of the same file (or of files with the same geometry)
+	// can share the cache of G-spheres
+	Wavecar_reader(const std::string& filename, std::shared_ptr<G_sphere_cache> g_sphere_cache = {})
+		: filename_(filename), g_sphere_cache_(std::move(g_sphere_cache))
 	{
+		if (!g_sphere_cache_)
+			g_sphere_cache_ = std::make_shared<G_sphere_cache>();
+
 		file_.exceptions(std::ifstream::badbit | std::ifstream::failbit);
 		file_.open(filename, std::ifstream::binary);
 
 		read_header();
 		compute_reciprocal();
+		detect_gamma_only();
+	}
+
+	// Makes coefficients be taken directly from the memory-mapped file
+	// instead of being read into a buffer
+	void enable_memory_map()
+	{
+		const auto coeff_size = is_single_precision() ? sizeof(std::complex<float>) : sizeof(std::complex<double>);
+		if (record_length_ % coeff_size != 0)
+			throw std::runtime_error("Bad WAVECAR: Record length is not a multiple of coefficient size");
+
+		mapped_file_ = std::make_shared<const Mapped_file>(filename_);
+	}
+
+	bool is_memory_mapped() const
+	{
+		return static_cast<bool>(mapped_file_);
+	}
+
+	const std::string& filename() const
+	{
+		return filename_;
+	}
+
+	const std::shared_ptr<G_sphere_cache>& g_sphere_cache() const
+	{
+		return g_sphere_cache_;
 	}
 
 	bool is_single_precision() const
@@ -45,6 +92,16 @@ public:
 		return precision_ == Precision::DOUBLE;
 	}
 
+	// Gamma-only WAVECAR files store only half of the G-sphere, coefficients
+	// of the other half are given by c(-G) = c*(G); stored coefficients with
+	// G != 0 are scaled by sqrt(2). The x-half layout of the default vasp_gam
+	// build is assumed: z-half files (-DwNGZhalf) have the same number of plane
+	// waves, cannot be told apart and are not supported
+	bool is_gamma_only() const
+	{
+		return is_gamma_only_;
+	}
+
 	std::size_t n_spins() const
 	{
 		return n_spins_;
@@ -105,18 +162,64 @@ public:
 		return 2 * max_g2_ + 1;
 	}
 
+	// Reads only the number of plane waves of the k-point
+	std::size_t n_plane_waves(std::size_t spin, std::size_t kpoint)
+	{
+		assert(spin < n_spins_);
+		assert(kpoint < n_kpoints_);
+
+		seek_record(kpoint_record(spin, kpoint));
+
+		double n_plane_waves;
+		read(n_plane_waves);
+		return to_positive_sizet(n_plane_waves);
+	}
+
+	// Reads only the k-vector of the k-point, which is the same for both spins
+	Vec3<double> get_kpoint(std::size_t kpoint)
+	{
+		assert(kpoint < n_kpoints_);
+
+		seek_record(kpoint_record(0, kpoint));
+		file_.ignore(sizeof(double));		// Skip the number of plane waves
+
+		Vec3<double> k;
+		read(k);
+		return k;
+	}
+
+	// Reads only band energies of the k-point
+	void get_kpoint_energies(std::size_t spin, std::size_t kpoint, std::vector<double>& energies)
+	{
+		assert(spin < n_spins_);
+		assert(kpoint < n_kpoints_);
+
+		energies.resize(n_bands_);
+		seek_record(kpoint_record(spin, kpoint));
+		file_.ignore(4 * sizeof(double));	// Skip the number of plane waves and the k-point
+
+		for (std::size_t i = 0; i < n_bands_; ++i)
+		{
+			read(energies[i]);
+			file_.ignore(2 * sizeof(double));	// Skip the energy imaginary part and the occupation
+		}
+	}
+
+	// Reads the k-point data (k-vector, energies, occupations and G-sphere)
+	// without coefficients
 	template<typename T>
-	void get_kpoint_data(std::size_t spin, std::size_t kpoint, Kpoint_data<T>& data)
+	void get_kpoint_header(std::size_t spin, std::size_t kpoint, Kpoint_data<T>& data)
 	{
 		assert(spin < n_spins_);
 		assert(kpoint < n_kpoints_);
 		assert(is_single_precision() == (std::is_same<T, float>::value));
 
+		data.spin = spin;
+		data.kpoint = kpoint;
 		data.energies.resize(n_bands_);
 		data.occupations.resize(n_bands_);
 
-		auto record = 2 + (n_bands_ + 1) * (spin * n_kpoints_ + kpoint);
-		seek_record(record);
+		seek_record(kpoint_record(spin, kpoint));
 
 		double n_plane_waves;
 		read(n_plane_waves);
@@ -131,17 +234,47 @@ public:
 			read(data.occupations[i]);
 		}
 
-		data.gs.reserve(data.n_plane_waves);
-		compute_g_lattice(data.k, data.gs);
+		data.gs = get_g_sphere(data.k, data.n_plane_waves);
 
-		if (data.gs.size() != data.n_plane_waves)
+		if (data.gs->size() != data.n_plane_waves)
 			throw std::runtime_error("Bad WAVECAR: Inconsistent number of plane waves");
+	}
 
-		data.coeffs.resize(data.n_plane_waves, n_bands_);
-		for (std::size_t i = 0; i < n_bands_; ++i)
+	// Reads coefficients of the bands [band_first, band_first + n_bands) of the k-point,
+	// whose header has already been read into (data)
+	template<typename T>
+	void get_kpoint_bands(std::size_t band_first, std::size_t n_bands, Kpoint_data<T>& data)
+	{
+		assert(band_first + n_bands <= n_bands_);
+		assert(n_bands > 0);
+
+		auto record = kpoint_record(data.spin, data.kpoint) + 1 + band_first;
+		data.band_first = band_first;
+
+		if (mapped_file_)
+		{
+			const auto first = record * record_length_;
+			const auto length = n_bands * record_length_;
+			if (first + length > mapped_file_->size())
+				throw std::runtime_error("Bad WAVECAR: Unexpected end of file");
+
+			mapped_file_->will_need(first, length);
+			data.mapped_file = mapped_file_;
+			data.coeffs = {reinterpret_cast<const std::complex<T>*>(mapped_file_->data() + first),
+				data.n_plane_waves, n_bands, record_length_ / sizeof(std::complex<T>)};
+		}
+		else
 		{
-			seek_record(++record);
-			read(&data.coeffs(0, i), data.n_plane_waves);
+			auto& buffer = data.coeffs_buffer;
+			buffer.resize(data.n_plane_waves, n_bands);
+			for (std::size_t i = 0; i < n_bands; ++i)
+			{
+				seek_record(record++);
+				read(&buffer(0, i), data.n_plane_waves);
+			}
+
+			data.coeffs = buffer.view();
+			data.mapped_file.reset();
 		}
 	}
 
@@ -199,6 +332,46 @@ private:
 		read(a_);
 	}
 
+	// Gamma-only files have the single k = 0 point with the number
+	// of plane waves equal to that of the half G-sphere
+	void detect_gamma_only()
+	{
+		if (n_kpoints_ != 1)
+			return;
+
+		seek_record(kpoint_record(0, 0));
+
+		double n_plane_waves;
+		read(n_plane_waves);
+
+		Vec3<double> k;
+		read(k);
+		if (k != Vec3<double>{0, 0, 0})
+			return;
+
+		// The half G-sphere is computed on trial and stays cached if the guess is right
+		is_gamma_only_ = true;
+		const auto n = to_positive_sizet(n_plane_waves);
+		is_gamma_only_ = (get_g_sphere(k, n)->size() == n);
+	}
+
+	// Returns the (cached) G-sphere, or the half of it for Gamma-only files
+	std::shared_ptr<const G_sphere> get_g_sphere(const Vec3<double>& k, std::size_t n_plane_waves)
+	{
+		auto gs = g_sphere_cache_->find(b_, e_cut_, k, is_gamma_only_);
+		if (!gs)
+		{
+			auto new_gs = std::make_shared<G_sphere>();
+			new_gs->reserve(n_plane_waves);
+			compute_g_lattice(k, *new_gs);
+
+			gs = new_gs;
+			g_sphere_cache_->insert(b_, e_cut_, k, is_gamma_only_, std::move(new_gs));
+		}
+
+		return gs;
+	}
+
 	void compute_reciprocal()
 	{
 		const auto uc_volume = a_[0] * (a_[1] ^ a_[2]);
@@ -214,9 +387,16 @@ private:
 		max_g2_ = static_cast<std::size_t>(std::floor(g_max_over_2pi * a2_norm())) + 1;
 	}
 
-	void compute_g_lattice(const Vec3<double>& k, std::vector<Vec3<std::size_t>>& gs) const
+	// Enumerates G-vectors row by row: for each (i1, i2) row, the range of i0 inside
+	// the sphere is obtained by solving the quadratic equation |g + (k0 + i0) b0|^2 = g_max^2,
+	// the result being the same as that of a brute-force loop over the whole G-lattice;
+	// for Gamma-only files, only the half with i0s > 0, or i0s = 0 and i1s > 0,
+	// or i0s = i1s = 0 and i2s >= 0 is enumerated
+	void compute_g_lattice(const Vec3<double>& k, G_sphere& gs) const
 	{
 		const auto two_m_e_cut_over_hbar_sq = TWO_M_OVER_HBAR_SQ * e_cut_;
+		const auto b0_norm_sq = norm_sq(b_[0]);
+		const auto max_g0 = static_cast<long long>(max_g0_);
 
 		gs.clear();
 		for (std::size_t i2 = 0; i2 < size_g2(); ++i2)
@@ -227,18 +407,46 @@ private:
 			{
 				const auto i1s = index_shift(i1, max_g1_);
 				const auto g2_p_g1 = g2 + (k[1] + i1s) * b_[1];
-				for (std::size_t i0 = 0; i0 < size_g0(); ++i0)
+
+				// |c + i0s b0|^2 < g_max^2, c = g2_p_g1 + k0 b0
+				const auto c = g2_p_g1 + k[0] * b_[0];
+				const auto c_dot_b0 = c * b_[0];
+				const auto discr = c_dot_b0 * c_dot_b0 - b0_norm_sq * (norm_sq(c) - two_m_e_cut_over_hbar_sq);
+				if (discr < 0)
+					continue;
+
+				// The range is extended by one point on both sides to be safe against
+				// round-off errors, all candidates are checked exactly below
+				const auto sqrt_discr = std::sqrt(discr);
+				const auto i0s_min = std::max(-max_g0,
+					static_cast<long long>(std::ceil((-c_dot_b0 - sqrt_discr) / b0_norm_sq)) - 1);
+				const auto i0s_max = std::min(max_g0,
+					static_cast<long long>(std::floor((-c_dot_b0 + sqrt_discr) / b0_norm_sq)) + 1);
+
+				const auto push_if_inside = [&](long long i0s)
 				{
-					const auto i0s = index_shift(i0, max_g0_);
+					if (is_gamma_only_ && (i0s < 0 || (i0s == 0 && (i1s < 0 || (i1s == 0 && i2s < 0)))))
+						return;
+
 					const auto g = g2_p_g1 + (k[0] + i0s) * b_[0];
-					const auto norm_g_sq = norm_sq(g);
-					if (norm_g_sq < two_m_e_cut_over_hbar_sq)
-						gs.push_back({i0, i1, i2});
-				}
+					if (norm_sq(g) < two_m_e_cut_over_hbar_sq)
+						gs.push_back({index_unshift(i0s, max_g0_), i1, i2});
+				};
+
+				// Non-negative shifted indices come first in the G-lattice order
+				for (auto i0s = std::max(i0s_min, 0LL); i0s <= i0s_max; ++i0s)
+					push_if_inside(i0s);
+				for (auto i0s = i0s_min; i0s <= std::min(i0s_max, -1LL); ++i0s)
+					push_if_inside(i0s);
 			}
 		}
 	}
 
+	std::size_t kpoint_record(std::size_t spin, std::size_t kpoint) const
+	{
+		return 2 + (n_bands_ + 1) * (spin * n_kpoints_ + kpoint);
+	}
+
 	void seek_record(std::size_t n)
 	{
 		file_.seekg(static_cast<unsigned long long>(n) * record_length_);
@@ -268,7 +476,20 @@ private:
 		return index;
 	}
 
+	// Inverse of index_shift()
+	static std::size_t index_unshift(long long index, std::size_t i_max)
+	{
+		if (index < 0)
+			index += 2 * static_cast<long long>(i_max) + 1;
+
+		return static_cast<std::size_t>(index);
+	}
+
 private:
+	const std::string filename_;
+	std::shared_ptr<G_sphere_cache> g_sphere_cache_;
+	std::shared_ptr<const Mapped_file> mapped_file_;
+
 	std::size_t record_length_;
 
 	std::size_t n_spins_;
@@ -286,6 +507,7 @@ private:
 	Basis3<double> b_;		// Reciprocal lattice
 
 	Precision precision_;
+	bool is_gamma_only_ = false;
 
 	std::ifstream file_;
 };